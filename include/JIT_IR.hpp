@@ -0,0 +1,101 @@
+#pragma once
+
+#include "JIT_compiler.hpp"
+
+/* Three-address SSA intermediate representation
+ * Every instruction defines a new virtual register exactly once,
+ * operands are virtual registers defined above:
+ *
+ * %0 = addr @a         : ptr
+ * %1 = load %0         : i32
+ * %2 = const 0x5       : i32
+ * %3 = mul %1, %2      : i32
+ * %4 = call @inc(%3)   : i32
+ * ret %4
+ *
+ * Function with several results (ExpressionType::List) stores them to the output array
+ */
+
+using vreg_t = uint32_t;
+
+enum class IR_Opcode {
+    Const,      //constant value
+    Address,    //address of the symbol
+    Load,       //read i32 from the address
+    Add,
+    Sub,
+    Mul,
+    Neg,
+    Call,       //call of the symbol with explicit argument list
+    Argument    //argument of the function, constant is its index
+};
+
+enum class IR_Type {
+    I32,
+    Ptr
+};
+
+struct IR_Instruction {
+    IR_Opcode opcode;
+    IR_Type type;
+    vreg_t result;
+    std::vector<vreg_t> arguments = {};
+    uint32_t constant = 0;          //value of Const, index of Argument
+    std::string symbol = {};        //name for Address and Call
+};
+
+struct IR_Function {
+    std::vector<IR_Instruction> instructions = {};
+    std::vector<vreg_t> results = {};
+    vreg_t next_register = 0;
+
+    vreg_t append(IR_Opcode opcode, IR_Type type, std::vector<vreg_t> arguments = {},
+                  uint32_t constant = 0, std::string symbol = {});
+    std::string dump() const;
+};
+
+IR_Function BuildIR(const Node* root);
+
+
+/* IR passes
+ * Every pass transforms the function in place and says if anything changed
+ */
+class IR_Pass {
+public:
+    virtual ~IR_Pass() = default;
+    virtual COMPILER_PASS pass() const = 0;
+    virtual bool run(IR_Function& function) = 0;
+};
+
+/* Computes operations on constants, applies identities (x+0, x*1, x-x, -(-x), x-(-y), ...)
+ * and merges constants of chains like (x + 3) - 5
+ */
+class ConstantFoldingPass : public IR_Pass {
+public:
+    COMPILER_PASS pass() const override { return COMPILER_PASS::Fold; }
+    bool run(IR_Function& function) override;
+};
+
+/* Reuses values computed by identical instructions.
+ * Loads are not reused across calls, calls are never reused
+ */
+class CommonSubexpressionPass : public IR_Pass {
+public:
+    COMPILER_PASS pass() const override { return COMPILER_PASS::CSE; }
+    bool run(IR_Function& function) override;
+};
+
+/* Removes instructions whose values are never used (calls are kept) */
+class DeadCodePass : public IR_Pass {
+public:
+    COMPILER_PASS pass() const override { return COMPILER_PASS::DCE; }
+    bool run(IR_Function& function) override;
+};
+
+class IR_PassManager {
+public:
+    void add(std::unique_ptr<IR_Pass> pass);
+    void run(IR_Function& function, PassManager& manager);
+private:
+    std::vector<std::unique_ptr<IR_Pass>> passes_;
+};
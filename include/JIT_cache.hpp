@@ -0,0 +1,134 @@
+#pragma once
+
+#include "JIT_compiler.hpp"
+
+#include <list>
+#include <mutex>
+#include <set>
+
+/* Cache of compiled functions
+ * Key is the canonical form of the expression (CanonicalForm) and the addresses
+ * of the symbols it names, so equivalent spellings share one function
+ * and the same text with other variables bound is compiled separately:
+ *
+ * CodeCache cache(1u << 20u);
+ * CodeCache::Pin pin(cache);
+ * auto f = reinterpret_cast<int (*)()>(cache.get("a * b + c", symbols));
+ * auto g = reinterpret_cast<int (*)()>(cache.get("c+(b*a)", symbols));     //f == g
+ *
+ * Every spelling seen is remembered, its next lookup does not parse the expression.
+ *
+ * With SYMBOL_ADDRESSING::TABLE the code of a canonical form is compiled once
+ * for all bindings, every binding gets a thunk with its table of addresses (TableThunk).
+ *
+ * Code is kept under the byte capacity: the least recently used functions are evicted,
+ * their blocks are reused by new ones. When a capacity worth of code has been evicted,
+ * live functions are copied into fresh regions and the old ones are unmapped (compaction).
+ * Memory of evicted and moved functions is reclaimed by epochs: it is released
+ * only after every Pin taken before the eviction is gone.
+ * A function may be called only while the Pin taken before get() is alive,
+ * from any thread, also while other threads insert (CodeMemory keeps its page executable)
+ */
+
+struct CodeCacheStats {
+    size_t hits = 0;
+    size_t canonical_hits = 0;  //hits of a new spelling, parsed but not compiled
+    size_t binding_hits = 0;    //new binding of compiled code (TABLE addressing), thunk only
+    size_t misses = 0;
+    size_t rejected = 0;        //not compiled, larger than the cache
+    size_t evictions = 0;
+    size_t compactions = 0;
+    size_t entries = 0;
+    size_t used_bytes = 0;      //code memory held by the entries
+    size_t retired_bytes = 0;   //evicted or moved, waiting for pins to be released
+    size_t mapped_bytes = 0;    //regions of the code memory, retired ones included
+};
+
+using CodeMappingFactory = std::function<std::unique_ptr<CodeMapping>()>;
+
+class CodeCache {
+public:
+    explicit CodeCache(size_t capacity_bytes,
+                       CompilerOptions options = CompilerOptions{},
+                       CodeMappingFactory mapping = []() { return std::make_unique<PageMapping>(); });
+
+    /* Functions got from the cache while the pin is alive stay in place */
+    class Pin {
+    public:
+        explicit Pin(CodeCache& cache);
+        ~Pin();
+
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+
+    private:
+        CodeCache& cache_;
+        std::multiset<uint64_t>::iterator epoch_;
+    };
+
+    /* Entry of the compiled expression, nullptr if it is larger than the capacity,
+     * the memory can not be mapped or a symbol is missing (TABLE addressing). Thread-safe
+     */
+    void* get(const char* expression, const symbol_t* externs);
+
+    /* Moves live functions into fresh regions, old regions are unmapped when unpinned */
+    void compact();
+
+    CodeCacheStats stats() const;
+
+private:
+    struct Entry {
+        CodeBlock block;                            //function, its thunk with TABLE addressing
+        std::list<std::string>::iterator age;       //place in recently_used_
+        std::vector<std::string> spellings = {};
+        std::string code = {};                      //key in codes_ with TABLE addressing
+    };
+
+    /* Code of a canonical form shared by its bindings (TABLE addressing) */
+    struct SharedCode {
+        CodeBlock block;
+        std::vector<std::string> symbols = {};      //slot order
+        size_t users = 0;                           //entries and get() in progress
+    };
+
+    struct Retired {
+        CodeBlock block;
+        CodeMemory* memory;         //nullptr if the whole memory is retired
+        uint64_t epoch;
+    };
+
+    struct RetiredMemory {
+        std::unique_ptr<CodeMemory> memory;
+        uint64_t epoch;
+    };
+
+    /* Text without spaces or canonical text, then addresses of the names */
+    static std::string make_key(const char* expression, const symbol_t* externs);
+
+    std::unique_ptr<CodeMemory> new_memory() const;
+    void* insert(std::string key, std::string canonical_key, const CodeBlock& block, std::string code);
+    void evict();
+    void retire(const CodeBlock& block);
+    void release_code(const std::string& key);
+    void compact_locked();
+    void reclaim();
+
+    size_t capacity_;
+    CompilerOptions options_;
+    CodeMappingFactory mapping_;
+    std::unique_ptr<CodeMemory> memory_;
+
+    std::unordered_map<std::string, Entry> entries_ = {};         //by canonical key
+    std::unordered_map<std::string, Entry*> spellings_ = {};      //by key of the text
+    std::list<std::string> recently_used_ = {};                   //canonical keys, most recent first
+    std::unordered_map<std::string, SharedCode> codes_ = {};      //by canonical form without addresses
+
+    uint64_t epoch_ = 0;
+    std::multiset<uint64_t> pins_ = {};                           //epochs when the pins were taken
+    std::vector<Retired> retired_ = {};
+    std::vector<RetiredMemory> retired_memories_ = {};
+    size_t evicted_since_compaction_ = 0;
+
+    CodeCacheStats stats_ = {};
+    mutable std::mutex mutex_;
+};
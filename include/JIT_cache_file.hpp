@@ -0,0 +1,85 @@
+#pragma once
+
+#include "JIT_compiler.hpp"
+
+#include <string_view>
+
+/* Compiled functions stored in a file ahead of time
+ * The writer compiles every expression once per canonical form. Literal words
+ * with symbol addresses are listed as relocations, so the file does not depend
+ * on where the symbols live. The loader maps the file, writes the addresses
+ * of the process into the listed words and makes the code executable:
+ *
+ * CodeCacheFile::Write("expressions.jit", expressions, symbols);
+ * ...
+ * CodeCacheFile file("expressions.jit", symbols);
+ * auto f = reinterpret_cast<int (*)()>(file.get("a * b + c"));
+ *
+ * Nothing is parsed or compiled for the spellings written to the file.
+ * The file is rejected (loaded() is false) if it is written by another version
+ * of the compiler, with other options, or names a symbol missing from the table.
+ * Read-only after loading, thread-safe
+ */
+
+class CodeCacheFile {
+public:
+    /* Bumped whenever the layout or the generated code changes */
+    static constexpr uint32_t VERSION = 1;
+
+    CodeCacheFile(const std::string& path, const symbol_t* externs, CompilerOptions options = CompilerOptions{});
+    ~CodeCacheFile();
+
+    CodeCacheFile(const CodeCacheFile&) = delete;
+    CodeCacheFile& operator=(const CodeCacheFile&) = delete;
+
+    /* Writes the file atomically (temporary file, then rename). False on I/O failure */
+    static bool Write(const std::string& path, const std::vector<std::string>& expressions,
+                      const symbol_t* externs, const CompilerOptions& options = CompilerOptions{});
+
+    bool loaded() const;
+
+    /* Entry of the expression, nullptr if it is not in the file.
+     * Unknown spelling is parsed and looked up by its canonical form
+     */
+    void* get(const char* expression) const;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t options;       //fingerprint of the compiler options
+        uint32_t entries;
+        uint32_t relocations;
+        uint32_t strings_size;
+        uint32_t code_offset;   //page aligned
+        uint32_t code_size;
+    };
+
+    struct Entry {
+        uint32_t canonical;     //1 if the key is a canonical form, 0 if a spelling without spaces
+        uint32_t key;           //offset in the string table
+        uint32_t code;          //offset in the code
+        uint32_t size;
+    };
+
+    struct Relocation {
+        uint32_t offset;        //of the literal word in the code
+        uint32_t symbol;        //offset of the name in the string table
+    };
+
+    static constexpr uint32_t MAGIC = 0x4354494a;      //"JITC"
+
+private:
+    bool load(int fd, const symbol_t* externs);
+    void* find(bool canonical, std::string_view key) const;
+
+    const symbol_t* externs_;
+    CompilerOptions options_;
+
+    uint8_t* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+
+    const Entry* entries_ = nullptr;            //sorted by (canonical, key)
+    size_t entry_count_ = 0;
+    const char* strings_ = nullptr;
+    uint8_t* code_ = nullptr;
+};
@@ -2,22 +2,33 @@
 
 #include <fstream>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <numeric>
 #include <optional>
+#include <set>
 #include <tuple>
+#include <unordered_map>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "JIT_encoder.hpp"
+#include "JIT_memory.hpp"
+
 using str_iter = std::string::iterator;
 using str_iter_const = std::string::const_iterator;
 
 class ARM_JIT_Compiler;
+struct IR_Function;
 
 /* ExpressionParser class
  * This class converts the given expression into tree
@@ -31,7 +42,11 @@ enum class ExpressionType {
     Plus,
     Minus,
     Product,
-    Function
+    Negate,
+    Function,
+    Argument,   //argument of the compiled function, content is its index
+    List,       //root of a function of several results, one subtree each
+    Value       //already computed into a register (instruction selection only)
 };
 
 struct Node {
@@ -40,6 +55,20 @@ struct Node {
     std::vector<std::unique_ptr<Node>> sub_expressions = {};
 };
 
+/* Literal word holding the address of the symbol */
+struct CodeRelocation {
+    size_t offset;          //bytes from the start of the code
+    std::string symbol;
+};
+
+/* Canonical text of the expression: chains of +/- and * are flattened,
+ * their constants folded and the terms sorted, constants are hex.
+ * Equivalent spellings give the same text:
+ *
+ * (b + a) * 2,  2 * (a + b + 0)  ->  *(+(a,b),0x2)
+ */
+std::string CanonicalForm(const Node* root);
+
 class ExpressionParser {
 public:
     explicit ExpressionParser(std::string expression);
@@ -61,6 +90,7 @@ private:
     void ParseArithmetic(Node *current_node, str_iter left, str_iter right, ExpressionType type, str_iter pos);
     void ParseFunction(Node *current_node, str_iter left, str_iter right);
     void ParseVariable(Node *current_node, str_iter left, str_iter right);
+    void ParseUnary(Node *current_node, str_iter left, str_iter right);
 
     static ExpressionType GetTypeFromChar(char current_char);
 
@@ -71,35 +101,204 @@ private:
 };
 
 
+/* ARM cores the instruction scheduler knows latencies for */
+enum class ARM_CORE {
+    Cortex_A7,
+    Cortex_A9,
+    Cortex_A53
+};
+
+/* -O0: tree is selected as it is parsed
+ * -O1: IR is folded and cleaned (fold, cse, dce)
+ * -O2: chains are reassociated and instructions scheduled as well
+ */
+enum class OPTIMIZATION_LEVEL {
+    O0,
+    O1,
+    O2
+};
+
+enum class COMPILER_PASS {
+    Parse,
+    Reassociate,
+    BuildIR,
+    Fold,
+    CSE,
+    DCE,
+    Select,
+    RegAlloc,
+    Schedule,
+    Frame,          //prologue and epilogue
+    Encode,
+    Count
+};
+
+const char* PassName(COMPILER_PASS pass);
+
+/* Where the code takes the addresses of the symbols from:
+ * LITERAL: literal pool words (listed as CodeRelocation)
+ * TABLE: table of addresses passed in r0, slot i holds the address of GetSymbolSlots()[i],
+ *        so the code does not depend on where the symbols are
+ */
+enum class SYMBOL_ADDRESSING {
+    LITERAL,
+    TABLE
+};
+
+/* Variables stored together (fields of one struct): the base address is loaded once,
+ * a variable is ldr rX, [base, #offset] and adjacent ones are loaded by one ldm.
+ * Names not in the block are taken from the symbol table
+ */
+struct VariableBlock {
+    void* base = nullptr;
+    std::map<std::string, uint32_t> offsets = {};   //bytes, multiples of 4, less than 4096 apart
+};
+
+struct CompilerOptions {
+    ARM_CORE core = ARM_CORE::Cortex_A7;
+    OPTIMIZATION_LEVEL level = OPTIMIZATION_LEVEL::O2;
+    std::set<COMPILER_PASS> disabled_passes = {};   //on top of the level, mandatory passes always run
+    std::optional<std::chrono::nanoseconds> budget = std::nullopt;  //compile time limit from the start
+    SYMBOL_ADDRESSING addressing = SYMBOL_ADDRESSING::LITERAL;
+    std::optional<VariableBlock> variable_block = std::nullopt;     //not with TABLE addressing
+    bool call_veneers = false;      //bl to a veneer in the literal pool instead of ldr ip + blx (LITERAL)
+};
+
+/* Options which change the generated code packed into a word,
+ * code stored for later runs is valid only for the same fingerprint
+ */
+uint32_t OptionsFingerprint(const CompilerOptions& options);
+
+struct PassTimings {
+    std::array<std::chrono::nanoseconds, static_cast<size_t>(COMPILER_PASS::Count)> time = {};
+    std::array<size_t, static_cast<size_t>(COMPILER_PASS::Count)> runs = {};
+    std::array<size_t, static_cast<size_t>(COMPILER_PASS::Count)> skipped = {};    //did not fit the budget
+
+    std::chrono::nanoseconds operator[](COMPILER_PASS pass) const { return time[static_cast<size_t>(pass)]; }
+    std::chrono::nanoseconds total() const;
+};
+
+/* Runs the passes enabled by the options and measures their time.
+ * With the budget set, optional pass is skipped if its estimated time
+ * together with the mandatory passes still to run does not fit the rest of it,
+ * so the baseline code is always produced
+ */
+class PassManager {
+public:
+    explicit PassManager(CompilerOptions options);
+
+    bool enabled(COMPILER_PASS pass) const;
+    static bool is_mandatory(COMPILER_PASS pass);
+    void set_size(size_t nodes) { size_ = nodes; }
+    std::chrono::nanoseconds elapsed() const;
+    const PassTimings& timings() const { return timings_; }
+
+    template<typename Function>
+    bool run(COMPILER_PASS pass, Function&& function);
+
+private:
+    CompilerOptions options_;
+    PassTimings timings_;
+    std::chrono::steady_clock::time_point start_;
+    size_t size_ = 0;       //nodes in the expression tree
+
+    std::chrono::nanoseconds estimate(COMPILER_PASS pass) const;
+    bool fits_budget(COMPILER_PASS pass) const;
+    void record(COMPILER_PASS pass, std::chrono::nanoseconds time);
+};
+
+template<typename Function>
+bool PassManager::run(COMPILER_PASS pass, Function&& function) {
+    if (!enabled(pass)) {
+        return false;
+    }
+    if (!fits_budget(pass)) {
+        ++timings_.skipped[static_cast<size_t>(pass)];
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    function();
+    record(pass, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start));
+    return true;
+}
+
+/* Literal words and call veneers waiting for their pool (encoder).
+ * ldr rX, [pc, #offset] and bl are patched when the pool is placed.
+ * Equal values share one entry, unless they are addresses of different symbols
+ * (relocations may give them different values). Functions of a module share one pool
+ */
+class LiteralPool {
+public:
+    static constexpr size_t RANGE = 4000;   //ldr [pc, #offset] reaches 4095 bytes forward
+
+    void add_literal(size_t position, uint32_t value, const std::optional<std::string>& symbol);
+    void add_veneer(size_t position, uint32_t address, const std::string& symbol);
+
+    /* True if the first ldr waiting would not reach the pool placed after words more */
+    bool is_due(size_t position, size_t words) const;
+    void place(CodeCursor& binary, bool branch_over, std::vector<CodeRelocation>* relocations);
+
+private:
+    struct Entry {
+        uint32_t value;
+        std::optional<std::string> symbol;
+        bool is_veneer;     //ldr pc, [pc, #-4]; .word value
+    };
+
+    size_t entry(Entry entry);
+
+    std::vector<Entry> entries_ = {};
+    std::map<std::tuple<bool, uint32_t, std::optional<std::string>>, size_t> index_ = {};
+    std::vector<std::pair<size_t, size_t>> pending_ = {};     //instruction position, entry
+    std::optional<size_t> first_literal_ = std::nullopt;      //veneers are reached from anywhere
+    size_t words_ = 0;
+};
+
 class ARM_JIT_Compiler {
 public:
-    explicit ARM_JIT_Compiler(std::map<std::string, void*>  address_map);
+    explicit ARM_JIT_Compiler(std::map<std::string, void*> address_map, CompilerOptions options = {});
     friend void TransferParsingTree(ExpressionParser& parser, ARM_JIT_Compiler& compiler);
+    void parse(const std::string& expression);
+    void parse_function(const std::string& definition);     //"f(x, y) = expression"
+    void parse_list(const std::vector<std::string>& expressions);
     void compile();
 
     template<typename OutputIterator>
     void print_assembly(OutputIterator& output);
     std::vector<uint32_t> GetCompiledBinary();
+    size_t EmitCompiledBinary(uint32_t* buffer, size_t capacity,
+                              std::vector<CodeRelocation>* relocations = nullptr);
+    size_t GetCompiledSize() const;
+    void EmitToModule(CodeCursor& cursor, LiteralPool& pool, std::vector<CodeRelocation>* relocations = nullptr);
+    const PassTimings& GetPassTimings() const;
+    std::string GetCanonicalForm() const;
+    const std::vector<std::string>& GetSymbolSlots() const;    //names in the table order (TABLE addressing)
 
 private:
 
     enum class ARM_INSTRUCTION {
-        ADD,            //r0 += r1
-        SUB,            //r0 -= r1
-        MUL,            //r0 *= r1
+        ADD,            //r0 = r1 + op2
+        SUB,            //r0 = r1 - op2
+        RSB,            //r0 = op2 - r1
+        MUL,            //r0 = r1 * r2
+        MLA,            //r0 = r3 + r1 * r2
+        MLS,            //r0 = r3 - r1 * r2
+        MOV,            //r0 = op2
+        MVN,            //r0 = ~op2
 
         BLX,            //blx *function*
+        BL,             //bl to the veneer of the function in the literal pool
 
-        LDR_FROM_NEXT,  //ldr r_i [pc, #-4]
-        LDR_REG,        //reading from address in register (Example: ldr r_i, [r_j])
+        LDR_LITERAL,    //ldr r_i, [pc, #offset] from the literal pool
+        LDR_REG,        //reading from address in register (Example: ldr r_i, [r_j, #offset])
+        LDM_REG,        //reading consecutive words to several registers (Example: ldmia r_i, {r_j, r_k})
+        STR_REG,        //writing to address in register (Example: str r_i, [r_j, #offset])
 
         PUSH_MULT_REG,  //pushing several registers
         PUSH_REG,       //pushing register
 
         POP_MULT_REG,   //popping several registers
         POP_REG,        //popping register
-
-        WORD_DECL,      //.word declaration
     };
     enum class ARM_REGISTER {
         R0 = 0,
@@ -107,123 +306,262 @@ private:
         R2 = 2,
         R3 = 3,
         R4 = 4,
-        LR = 5,
-        PC = 6
+        R5 = 5,
+        R6 = 6,
+        R7 = 7,
+        R8 = 8,
+        R9 = 9,
+        R10 = 10,
+        R11 = 11,
+        IP = 12,
+        SP = 13,
+        LR = 14,
+        PC = 15
+        //numbers from VIRTUAL_REGISTERS are virtual registers before allocation
     };
 
     using ARM_R = ARM_REGISTER;
 
     using ARM_I = ARM_INSTRUCTION;
 
-    using instruction_t = std::tuple<ARM_INSTRUCTION,
-            std::optional<ARM_REGISTER>,
-            std::optional<ARM_REGISTER>,
-            std::optional<std::string>>;
+    /* op2 (second operand of data processing instructions) is
+     * immediate if it is set, otherwise reg3 shifted left by shift
+     */
+    struct instruction_t {
+        ARM_INSTRUCTION type;
+        std::optional<ARM_REGISTER> reg1;       //destination
+        std::optional<ARM_REGISTER> reg2;       //first operand
+        std::optional<ARM_REGISTER> reg3;       //second operand
+        std::optional<std::string> content;     //literal value
+        std::optional<uint32_t> immediate = std::nullopt;
+        uint32_t shift = 0;
+        std::optional<ARM_REGISTER> reg4 = std::nullopt;  //accumulator of mla/mls
+        std::optional<std::string> symbol = std::nullopt; //name whose address is the literal
+        std::vector<ARM_REGISTER> registers = {};         //ldm destinations, ascending
+        bool is_stack_argument = false;     //offset is from sp at the entry, the prologue adds its size
+
+        instruction_t(ARM_INSTRUCTION type,
+                      std::optional<ARM_REGISTER> reg1,
+                      std::optional<ARM_REGISTER> reg2,
+                      std::optional<ARM_REGISTER> reg3,
+                      std::optional<std::string> content,
+                      std::optional<uint32_t> immediate = std::nullopt,
+                      uint32_t shift = 0,
+                      std::optional<ARM_REGISTER> reg4 = std::nullopt)
+            : type(type), reg1(reg1), reg2(reg2), reg3(reg3), content(std::move(content)),
+              immediate(immediate), shift(shift), reg4(reg4) {}
+    };
     std::vector<instruction_t> instructions_;
     std::unique_ptr<Node> parse_tree_;
 
     std::map<std::string, void*> address_map_;
-    void compile_(Node* current);
+    CompilerOptions options_;
+    PassManager passes_;
+
+    static constexpr size_t VIRTUAL_REGISTERS = 16;
+    size_t next_virtual_register_ = VIRTUAL_REGISTERS;
+    size_t spill_slots_ = 0;                        //words of the stack frame
+    std::optional<ARM_REGISTER> table_register_;    //symbol table from r0 (TABLE addressing)
+    std::vector<std::string> symbol_slots_ = {};
+    std::optional<ARM_REGISTER> block_register_;    //base of the variable block
+    uint32_t block_start_ = 0;                      //offset the block register points to
+    static constexpr size_t LDM_REGISTERS = 4;      //longest run of variables loaded by one ldm
+    std::map<uint32_t, ARM_REGISTER> argument_registers_ = {};     //argument index -> copied at the entry
+
+    using term_t = std::pair<std::unique_ptr<Node>, bool>; //subtree and "is negated" flag
+
+    void reassociate(Node* current);
+    void collect_terms(std::unique_ptr<Node> current, ExpressionType chain_type,
+                       bool negated, std::vector<term_t>& terms);
+    static std::unique_ptr<Node> make_negate(std::unique_ptr<Node> operand);
+    static std::unique_ptr<Node> build_balanced(std::vector<std::unique_ptr<Node>>& operands,
+                                                size_t left, size_t right, ExpressionType type);
+
+    /* Instruction selection (JIT_selector.cpp)
+     * Bottom-up rewrite system: every node is labeled with the cheapest rule
+     * for every nonterminal, then the tree is reduced from the root
+     */
+    enum class NonTerminal {
+        Reg,            //value in register
+        Imm,            //constant encodable as op2 immediate
+        NegImm,         //constant with encodable negation
+        Shift,          //constant 2^k, k is the value
+        ShiftPlusOne,   //constant 2^k+1
+        ShiftMinusOne,  //constant 2^k-1
+        Shifted,        //register shifted left: op2 form
+        Count
+    };
+    using NT = NonTerminal;
+
+    struct Operand {
+        std::optional<ARM_REGISTER> reg = std::nullopt;
+        std::optional<uint32_t> immediate = std::nullopt;
+        uint32_t shift = 0;
+    };
+
+    struct Pattern {
+        std::optional<ExpressionType> op;      //std::nullopt for nonterminal leaf
+        NonTerminal leaf = NonTerminal::Reg;
+        std::vector<Pattern> children = {};
+        bool variadic = false;                  //every child matches children[0]
+    };
+
+    using predicate_t = bool (*)(const Node*);
+    using emitter_t = Operand (*)(ARM_JIT_Compiler&, ARM_REGISTER, const Node*, const std::vector<Operand>&);
+
+    struct Rule {
+        NonTerminal result;
+        Pattern pattern;
+        size_t cost;
+        predicate_t predicate;
+        emitter_t emit;
+    };
+
+    struct Label {
+        std::array<size_t, static_cast<size_t>(NonTerminal::Count)> cost;
+        std::array<const Rule*, static_cast<size_t>(NonTerminal::Count)> rule;
+    };
+
+    static const std::vector<Rule>& rules();
+    std::unordered_map<const Node*, Label> labels_;
+    std::map<std::pair<const Node*, NonTerminal>, size_t> registers_needed_;
+
+    void label(const Node* current);
+    size_t match(const Pattern& pattern, const Node* current) const;
+    void collect_leaves(const Pattern& pattern, const Node* current,
+                        std::vector<std::pair<const Node*, NonTerminal>>& leaves) const;
+    size_t registers_needed(const Node* current, NonTerminal goal);
+    Operand reduce(const Node* current, NonTerminal goal);
+    void lower(const IR_Function& function);
+
+    void emit(ARM_INSTRUCTION type, ARM_REGISTER rd, std::optional<ARM_REGISTER> rn, const Operand& op2);
+    void emit_call(ARM_REGISTER rd, const std::string& name, const std::vector<Operand>& arguments);
+    void load_address(ARM_REGISTER rd, const std::string& name);
+    void load_variable(ARM_REGISTER rd, const std::string& name);
+    std::optional<uint32_t> block_offset(const std::string& name) const;
+
+    /* Register allocation (JIT_regalloc.cpp) */
+    void allocate_registers();
+    static void instruction_registers(const instruction_t& instruction,
+                                      std::vector<ARM_REGISTER>& defs,
+                                      std::vector<ARM_REGISTER>& uses);
+
+    void schedule();
 
     void add_header();
     void add_footer();
 
-    void handle_const(Node* current);
-    void handle_variable(Node* current);
-    void handle_plus(Node* current);
-    void handle_minus(Node* current);
-    void handle_product(Node* current);
-    void handle_function(Node* current);
+    ARM_REGISTER saved_register_last() const;
+    ARM_REGISTER new_virtual_register();
+    static bool is_virtual(ARM_REGISTER reg);
+    static std::string register_name(ARM_REGISTER reg);
+    static std::string op2_text(const instruction_t& instruction);
+    static constexpr uint32_t register_list(std::optional<ARM_REGISTER> first,
+                                            std::optional<ARM_REGISTER> last,
+                                            std::optional<ARM_REGISTER> extra) {
+        /* Register mask for push/pop: {first-last, extra} */
+        return A32_RegisterRange(static_cast<uint32_t>(*first), static_cast<uint32_t>(*last)) |
+               (extra ? 1u << static_cast<uint32_t>(*extra) : 0u);
+    }
+    static A32_Operand2 encode_op2(const instruction_t& instruction);
+    void encode(CodeCursor& binary, std::vector<CodeRelocation>* relocations = nullptr,
+                LiteralPool* shared_pool = nullptr) const;
+    std::string get_address(const std::string& name) const;
 };
 
 template<typename OutputIterator>
 void ARM_JIT_Compiler::print_assembly(OutputIterator& output) {
-    bool skipped = false;
-    size_t counter = 0;
-
     for(const auto& instruction : instructions_) {
-        std::string param_1 = std::get<1>(instruction) ?
-                              std::to_string(static_cast<int>(*std::get<1>(instruction))) : "";
-
-        std::string param_2 = std::get<2>(instruction) ?
-                              std::to_string(static_cast<int>(*std::get<2>(instruction))) : "";
-
+        std::string param_1 = instruction.reg1 ? register_name(*instruction.reg1) : "";
+        std::string param_2 = instruction.reg2 ? register_name(*instruction.reg2) : "";
+        std::string param_3 = instruction.reg3 ? register_name(*instruction.reg3) : "";
+        std::string param_4 = instruction.reg4 ? register_name(*instruction.reg4) : "";
 
-        switch (std::get<0>(instruction)) {
+        switch (instruction.type) {
             case ARM_I::ADD:
-                *output = std::string("add\t") +
-                          "r" + param_1 + ", " +
-                          "r" + param_2 + ", " +
-                          "r" + param_1 + "\n";
+                *output = std::string("add\t") + param_1 + ", " + param_2 + ", " + op2_text(instruction) + "\n";
                 break;
 
             case ARM_I::SUB:
-                *output = std::string("sub\t") +
-                          "r" + param_1 + ", " +
-                          "r" + param_2 + ", " +
-                          "r" + param_1 + "\n";
+                *output = std::string("sub\t") + param_1 + ", " + param_2 + ", " + op2_text(instruction) + "\n";
+                break;
+
+            case ARM_I::RSB:
+                *output = std::string("rsb\t") + param_1 + ", " + param_2 + ", " + op2_text(instruction) + "\n";
                 break;
 
             case ARM_I::MUL:
-                *output = std::string("mul\t") +
-                          "r" + param_1 + ", " +
-                          "r" + param_2 + ", " +
-                          "r" + param_1 + "\n";
+                *output = std::string("mul\t") + param_1 + ", " + param_2 + ", " + param_3 + "\n";
+                break;
+
+            case ARM_I::MLA:
+                *output = std::string("mla\t") + param_1 + ", " + param_2 + ", " + param_3 + ", " + param_4 + "\n";
+                break;
+
+            case ARM_I::MLS:
+                *output = std::string("mls\t") + param_1 + ", " + param_2 + ", " + param_3 + ", " + param_4 + "\n";
+                break;
+
+            case ARM_I::MOV:
+                *output = std::string("mov\t") + param_1 + ", " + op2_text(instruction) + "\n";
+                break;
+
+            case ARM_I::MVN:
+                *output = std::string("mvn\t") + param_1 + ", " + op2_text(instruction) + "\n";
                 break;
 
             case ARM_I::BLX:
-                *output = std::string("blx\t") +
-                          "r" + param_1 + "\n";
+                *output = std::string("blx\t") + param_1 + "\n";
+                break;
+
+            case ARM_I::BL:
+                *output = std::string("bl\t") + *instruction.symbol + "\n";
                 break;
 
-            case ARM_I::LDR_FROM_NEXT:
-                *output = std::string("ldr\t") +
-                          "r" + param_1 + ", " +
-                          "[pc]" + "\n";
+            case ARM_I::LDR_LITERAL:
+                *output = std::string("ldr\t") + param_1 + ", =" + *instruction.content + "\n";
                 break;
 
             case ARM_I::LDR_REG:
-                *output = std::string("ldr\t") +
-                          "r" + param_1 + ", " +
-                          "[" + "r" + param_2 + "]" + "\n";
+                *output = std::string("ldr\t") + param_1 + ", [" + param_2 +
+                          (instruction.immediate ? ", #" + std::to_string(*instruction.immediate) : "") + "]\n";
                 break;
 
-            case ARM_I::PUSH_REG:
-                *output = std::string("push\t{r") +
-                          param_1 + "}\n";
+            case ARM_I::LDM_REG: {
+                std::string list = {};
+                for (ARM_REGISTER reg : instruction.registers) {
+                    list += (list.empty() ? "" : ", ") + register_name(reg);
+                }
+                *output = std::string(instruction.immediate == 4u ? "ldmib\t" : "ldmia\t") + param_2 +
+                          ", {" + list + "}\n";
                 break;
+            }
 
-            case ARM_I::PUSH_MULT_REG:
-                *output = std::string("push\t{r") +
-                          param_1 + "-r" +
-                          param_2 +
-                          + "}\n";
+            case ARM_I::STR_REG:
+                *output = std::string("str\t") + param_1 + ", [" + param_2 +
+                          (instruction.immediate ? ", #" + std::to_string(*instruction.immediate) : "") + "]\n";
                 break;
 
-            case ARM_I::WORD_DECL:
+            case ARM_I::PUSH_REG:
+                *output = std::string("push\t{") + param_1 + "}\n";
+                break;
 
-                *output = std::string("b\tskip") + std::to_string(counter) +
-                          std::string("\n.word\t") +
-                          std::string(*std::get<3>(instruction)) + "\n" +
-                          std::string("skip") + std::to_string(counter) + std::string(":\n");
-                ++counter;
+            case ARM_I::PUSH_MULT_REG:
+                *output = std::string("push\t{") + param_1 + "-" + param_2 +
+                          (param_3.empty() ? "" : ", " + param_3) + "}\n";
                 break;
 
             case ARM_I::POP_MULT_REG:
-                *output = std::string("pop\t{r") +
-                          param_1 + "-r" +
-                          param_2 +
-                          + "}\n";
+                *output = std::string("pop\t{") + param_1 + "-" + param_2 +
+                          (param_3.empty() ? "" : ", " + param_3) + "}\n";
                 break;
 
             case ARM_I::POP_REG:
-                *output = std::string("pop\t{r") +
-                          param_1
-                          + "}\n";
+                *output = std::string("pop\t{") + param_1 + "}\n";
                 break;
 
             default:
-                std::cout << static_cast<size_t>(std::get<0>(instruction));
+                std::cout << static_cast<size_t>(instruction.type);
                 *output = std::string("UNKNOWN_INSTRUCTION\n");
                 break;
         }
@@ -237,7 +575,133 @@ typedef struct {
     void       * pointer;
 } symbol_t;
 
+/* Names to addresses, the table ends with {.name=0, .pointer=0} */
+std::map<std::string, void*> AddressMap(const symbol_t* externs);
+
+/* Addresses for the table of position-independent code (SYMBOL_ADDRESSING::TABLE)
+ * in the slot order, nullptr for a name missing from externs
+ */
+std::vector<void*> SymbolTable(const std::vector<std::string>& symbol_slots, const symbol_t* externs);
+
+/* Function without arguments which calls the position-independent code
+ * with the table stored right after it:
+ *
+ * add r0, pc, #4
+ * ldr pc, [pc, #-4]
+ * .word entry          (word TABLE_THUNK_ENTRY)
+ * .word table[0], ...
+ */
+std::vector<uint32_t> TableThunk(const void* entry, const std::vector<void*>& table);
+constexpr size_t TABLE_THUNK_ENTRY = 2;
+
 extern void
 jit_compile_expression_to_arm(const char * expression,
                               const symbol_t * externs,
-                              void * out_buffer);
\ No newline at end of file
+                              void * out_buffer);
+
+extern void
+jit_compile_expression_to_arm_with_options(const char * expression,
+                                           const symbol_t * externs,
+                                           void * out_buffer,
+                                           const CompilerOptions & options);
+
+/* Compiles into out_buffer of capacity bytes without intermediate copies.
+ * If the code does not fit, status is JIT_BUFFER_TOO_SMALL, size is the capacity
+ * needed and the buffer contents are unspecified
+ */
+typedef enum {
+    JIT_OK,
+    JIT_BUFFER_TOO_SMALL
+} jit_status_t;
+
+typedef struct {
+    jit_status_t status;
+    size_t size;        //bytes written or needed
+} jit_emit_result_t;
+
+extern jit_emit_result_t
+jit_compile_expression_to_arm_buffer(const char * expression,
+                                     const symbol_t * externs,
+                                     void * out_buffer,
+                                     size_t capacity,
+                                     const CompilerOptions & options = CompilerOptions{});
+
+/* Position-independent code: int f(void* const* table), table[i] is the address
+ * of symbol_slots[i] (SymbolTable). Compiled without any addresses, so one function
+ * serves every binding of the names it uses
+ */
+extern jit_emit_result_t
+jit_compile_expression_to_pic_buffer(const char * expression,
+                                     void * out_buffer,
+                                     size_t capacity,
+                                     std::vector<std::string> & symbol_slots,
+                                     const CompilerOptions & options = CompilerOptions{});
+
+/* Function of arguments, "f(x, y, z) = x * y + z" is int f(int x, int y, int z) by AAPCS:
+ * the first four arguments in r0-r3, the others on the stack, the result in r0.
+ * Other names are taken from externs. With TABLE addressing the table is the first argument
+ */
+extern jit_emit_result_t
+jit_compile_function_to_buffer(const char * definition,
+                               const symbol_t * externs,
+                               void * out_buffer,
+                               size_t capacity,
+                               const CompilerOptions & options = CompilerOptions{});
+
+extern CodeBlock
+jit_compile_function_to_memory(const char * definition,
+                               const symbol_t * externs,
+                               CodeMemory & memory,
+                               const CompilerOptions & options = CompilerOptions{});
+
+/* Several expressions in one function void f(int32_t* results), results[i] is the value
+ * of expressions[i] (up to 1024). Loads, literals and common subexpressions are shared,
+ * there is one prologue and epilogue. The array must not overlap the variables.
+ * With TABLE addressing the table is the first argument and the array the second
+ */
+extern jit_emit_result_t
+jit_compile_expressions_to_buffer(const std::vector<std::string> & expressions,
+                                  const symbol_t * externs,
+                                  void * out_buffer,
+                                  size_t capacity,
+                                  const CompilerOptions & options = CompilerOptions{});
+
+extern CodeBlock
+jit_compile_expressions_to_memory(const std::vector<std::string> & expressions,
+                                  const symbol_t * externs,
+                                  CodeMemory & memory,
+                                  const CompilerOptions & options = CompilerOptions{});
+
+/* Compiles into a block of the code memory. The function can be called
+ * after memory.commit() and is released by memory.free(block).
+ * Empty block if the memory can not be mapped
+ */
+extern CodeBlock
+jit_compile_expression_to_memory(const char * expression,
+                                 const symbol_t * externs,
+                                 CodeMemory & memory,
+                                 const CompilerOptions & options = CompilerOptions{});
+
+/* Exact size in bytes of the code and its literal pools for the expression.
+ * Nothing is written. Equal addresses share a literal, so the size
+ * depends on the symbol table as well. options.budget is ignored: passes skipped
+ * by the budget depend on timings, so the size holds for compilations without one
+ */
+extern size_t
+jit_expression_code_size(const char * expression,
+                         const symbol_t * externs,
+                         const CompilerOptions & options = CompilerOptions{});
+
+/* Pass timings of the last compilation in this thread */
+extern PassTimings
+jit_last_pass_timings();
+
+/* Compilations with the budget: finished in time, late, optional passes skipped */
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t skipped_passes;
+} budget_counters_t;
+
+extern budget_counters_t
+jit_budget_counters();
\ No newline at end of file
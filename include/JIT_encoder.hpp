@@ -0,0 +1,301 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+
+/* A32 instruction encoder
+ * Every word is the fixed bits of the opcode from the table
+ * with condition, registers and operands put into their fields.
+ * Registers are numbers 0-15 (13 = sp, 14 = lr, 15 = pc)
+ */
+
+enum class A32_CONDITION : uint32_t {
+    EQ = 0x0,
+    NE = 0x1,
+    HS = 0x2,
+    LO = 0x3,
+    MI = 0x4,
+    PL = 0x5,
+    VS = 0x6,
+    VC = 0x7,
+    HI = 0x8,
+    LS = 0x9,
+    GE = 0xa,
+    LT = 0xb,
+    GT = 0xc,
+    LE = 0xd,
+    AL = 0xe
+};
+
+enum class A32_FORMAT {
+    DataProcessing,     //op rd, rn, op2
+    Multiply,           //op rd, rn, rm, ra
+    LoadStore,          //op rt, [rn, #offset]
+    BlockTransfer,      //op rn, {registers}
+    Branch,             //op label
+    BranchExchange      //op rm
+};
+
+enum class A32_OPCODE {
+    //data processing, in the order of the opcode field
+    AND, EOR, SUB, RSB, ADD, ADC, SBC, RSC, TST, TEQ, CMP, CMN, ORR, MOV, BIC, MVN,
+    MUL, MLA, MLS,
+    LDR, STR, LDRB, STRB,
+    LDM, STM,
+    B, BL,
+    BX, BLX,
+    Count
+};
+
+enum class A32_SHIFT : uint32_t {
+    LSL = 0,
+    LSR = 1,
+    ASR = 2,
+    ROR = 3
+};
+
+/* Addressing of single load/store: [rn, #offset], [rn, #offset]! or [rn], #offset */
+enum class A32_INDEX {
+    Offset,
+    PreIndexed,
+    PostIndexed
+};
+
+/* Addressing of LDM/STM: increment/decrement after/before */
+enum class A32_BLOCK : uint32_t {
+    DA = 0x0,
+    IA = 0x1,
+    DB = 0x2,
+    IB = 0x3
+};
+
+struct A32_OpcodeInfo {
+    A32_FORMAT format;
+    uint32_t fixed;     //bits of the encoding which do not depend on operands
+};
+
+constexpr std::array<A32_OpcodeInfo, static_cast<size_t>(A32_OPCODE::Count)> A32_OPCODES = {{
+    {A32_FORMAT::DataProcessing, 0x0u << 21u},                //and
+    {A32_FORMAT::DataProcessing, 0x1u << 21u},                //eor
+    {A32_FORMAT::DataProcessing, 0x2u << 21u},                //sub
+    {A32_FORMAT::DataProcessing, 0x3u << 21u},                //rsb
+    {A32_FORMAT::DataProcessing, 0x4u << 21u},                //add
+    {A32_FORMAT::DataProcessing, 0x5u << 21u},                //adc
+    {A32_FORMAT::DataProcessing, 0x6u << 21u},                //sbc
+    {A32_FORMAT::DataProcessing, 0x7u << 21u},                //rsc
+    {A32_FORMAT::DataProcessing, 0x8u << 21u | 1u << 20u},    //tst, always sets flags
+    {A32_FORMAT::DataProcessing, 0x9u << 21u | 1u << 20u},    //teq
+    {A32_FORMAT::DataProcessing, 0xau << 21u | 1u << 20u},    //cmp
+    {A32_FORMAT::DataProcessing, 0xbu << 21u | 1u << 20u},    //cmn
+    {A32_FORMAT::DataProcessing, 0xcu << 21u},                //orr
+    {A32_FORMAT::DataProcessing, 0xdu << 21u},                //mov
+    {A32_FORMAT::DataProcessing, 0xeu << 21u},                //bic
+    {A32_FORMAT::DataProcessing, 0xfu << 21u},                //mvn
+    {A32_FORMAT::Multiply, 0x00000090},                       //mul
+    {A32_FORMAT::Multiply, 0x00200090},                       //mla: accumulate bit
+    {A32_FORMAT::Multiply, 0x00600090},                       //mls
+    {A32_FORMAT::LoadStore, 0x04100000},                      //ldr: load bit
+    {A32_FORMAT::LoadStore, 0x04000000},                      //str
+    {A32_FORMAT::LoadStore, 0x04500000},                      //ldrb: byte and load bits
+    {A32_FORMAT::LoadStore, 0x04400000},                      //strb
+    {A32_FORMAT::BlockTransfer, 0x08100000},                  //ldm: load bit
+    {A32_FORMAT::BlockTransfer, 0x08000000},                  //stm
+    {A32_FORMAT::Branch, 0x0a000000},                         //b
+    {A32_FORMAT::Branch, 0x0b000000},                         //bl: link bit
+    {A32_FORMAT::BranchExchange, 0x012fff10},                 //bx
+    {A32_FORMAT::BranchExchange, 0x012fff30},                 //blx: link bit
+}};
+
+/* Second operand of data processing: modified immediate or shifted register */
+struct A32_Operand2 {
+    uint32_t bits = 0;          //bits 0-11
+    bool is_immediate = false;  //bit 25
+
+    static constexpr std::optional<A32_Operand2> Immediate(uint32_t value);
+    static constexpr A32_Operand2 Register(uint32_t rm, A32_SHIFT shift = A32_SHIFT::LSL, uint32_t amount = 0);
+    static constexpr A32_Operand2 RegisterShifted(uint32_t rm, A32_SHIFT shift, uint32_t rs);
+};
+
+/* Modified immediate: 8-bit value rotated right by an even number of bits.
+ * Returns rotate_imm and imm8 fields or std::nullopt
+ */
+constexpr std::optional<uint32_t> A32_ModifiedImmediate(uint32_t value) {
+    for (uint32_t rotation = 0; rotation < 16; ++rotation) {
+        uint32_t amount = 2 * rotation;
+        uint32_t imm8 = amount == 0 ? value : (value << amount) | (value >> (32 - amount));
+        if (imm8 <= 0xff) {
+            return rotation << 8u | imm8;
+        }
+    }
+    return std::nullopt;
+}
+
+constexpr std::optional<A32_Operand2> A32_Operand2::Immediate(uint32_t value) {
+    auto encoded = A32_ModifiedImmediate(value);
+    if (!encoded) {
+        return std::nullopt;
+    }
+    return A32_Operand2{*encoded, true};
+}
+
+constexpr A32_Operand2 A32_Operand2::Register(uint32_t rm, A32_SHIFT shift, uint32_t amount) {
+    assert(rm < 16 && amount < 32);
+    return A32_Operand2{amount << 7u | static_cast<uint32_t>(shift) << 5u | rm, false};
+}
+
+constexpr A32_Operand2 A32_Operand2::RegisterShifted(uint32_t rm, A32_SHIFT shift, uint32_t rs) {
+    assert(rm < 16 && rs < 16);
+    return A32_Operand2{rs << 8u | static_cast<uint32_t>(shift) << 5u | 1u << 4u | rm, false};
+}
+
+constexpr uint32_t A32_Fixed(A32_OPCODE opcode, [[maybe_unused]] A32_FORMAT format, A32_CONDITION condition) {
+    const A32_OpcodeInfo& info = A32_OPCODES[static_cast<size_t>(opcode)];
+    assert(info.format == format);
+    return static_cast<uint32_t>(condition) << 28u | info.fixed;
+}
+
+/* op rd, rn, op2 (mov and mvn ignore rn, tst/teq/cmp/cmn ignore rd) */
+constexpr uint32_t A32_DataProcessing(A32_OPCODE opcode, uint32_t rd, uint32_t rn, A32_Operand2 op2,
+                                      bool set_flags = false, A32_CONDITION condition = A32_CONDITION::AL) {
+    assert(rd < 16 && rn < 16);
+    return A32_Fixed(opcode, A32_FORMAT::DataProcessing, condition) |
+           (op2.is_immediate ? 1u << 25u : 0u) |
+           (set_flags ? 1u << 20u : 0u) |
+           rn << 16u | rd << 12u | op2.bits;
+}
+
+/* mul rd, rn, rm / mla rd, rn, rm, ra / mls rd, rn, rm, ra */
+constexpr uint32_t A32_Multiply(A32_OPCODE opcode, uint32_t rd, uint32_t rn, uint32_t rm, uint32_t ra = 0,
+                                A32_CONDITION condition = A32_CONDITION::AL) {
+    assert(rd < 16 && rn < 16 && rm < 16 && ra < 16);
+    return A32_Fixed(opcode, A32_FORMAT::Multiply, condition) | rd << 16u | ra << 12u | rm << 8u | rn;
+}
+
+/* op rt, [rn, #offset] with 12-bit offset of any sign */
+constexpr uint32_t A32_LoadStore(A32_OPCODE opcode, uint32_t rt, uint32_t rn, int32_t offset,
+                                 A32_INDEX index = A32_INDEX::Offset,
+                                 A32_CONDITION condition = A32_CONDITION::AL) {
+    assert(rt < 16 && rn < 16 && -4096 < offset && offset < 4096);
+    uint32_t magnitude = offset < 0 ? static_cast<uint32_t>(-offset) : static_cast<uint32_t>(offset);
+    uint32_t pre_indexed = index == A32_INDEX::PostIndexed ? 0u : 1u;
+    uint32_t writeback = index == A32_INDEX::PreIndexed ? 1u : 0u;
+    return A32_Fixed(opcode, A32_FORMAT::LoadStore, condition) |
+           pre_indexed << 24u | (offset < 0 ? 0u : 1u) << 23u | writeback << 21u |
+           rn << 16u | rt << 12u | magnitude;
+}
+
+/* op rn{!}, {registers}: ldmia sp!, {...} is pop, stmdb sp!, {...} is push */
+constexpr uint32_t A32_BlockTransfer(A32_OPCODE opcode, uint32_t rn, uint32_t registers, A32_BLOCK block,
+                                     bool writeback, A32_CONDITION condition = A32_CONDITION::AL) {
+    assert(rn < 16 && registers != 0 && registers <= 0xffff);
+    return A32_Fixed(opcode, A32_FORMAT::BlockTransfer, condition) |
+           static_cast<uint32_t>(block) << 23u | (writeback ? 1u : 0u) << 21u |
+           rn << 16u | registers;
+}
+
+/* Register mask {first-last} */
+constexpr uint32_t A32_RegisterRange(uint32_t first, uint32_t last) {
+    assert(first <= last && last < 16);
+    return ((1u << (last + 1)) - 1) & ~((1u << first) - 1);
+}
+
+/* push {registers}: stmdb sp!, {registers} */
+constexpr uint32_t A32_Push(uint32_t registers) {
+    return A32_BlockTransfer(A32_OPCODE::STM, 13, registers, A32_BLOCK::DB, true);
+}
+
+/* pop {registers}: ldmia sp!, {registers} */
+constexpr uint32_t A32_Pop(uint32_t registers) {
+    return A32_BlockTransfer(A32_OPCODE::LDM, 13, registers, A32_BLOCK::IA, true);
+}
+
+/* b/bl to pc + 8 + 4 * offset */
+constexpr uint32_t A32_Branch(A32_OPCODE opcode, int32_t offset, A32_CONDITION condition = A32_CONDITION::AL) {
+    assert(-(1 << 23) <= offset && offset < (1 << 23));
+    return A32_Fixed(opcode, A32_FORMAT::Branch, condition) | (static_cast<uint32_t>(offset) & 0xffffffu);
+}
+
+/* bx rm / blx rm */
+constexpr uint32_t A32_BranchExchange(A32_OPCODE opcode, uint32_t rm, A32_CONDITION condition = A32_CONDITION::AL) {
+    assert(rm < 16);
+    return A32_Fixed(opcode, A32_FORMAT::BranchExchange, condition) | rm;
+}
+
+
+
+/* Output of the encoder: code words written into memory of fixed capacity.
+ * Words past the capacity are counted but not written, so after an overflow
+ * size() is the capacity needed. Null memory with zero capacity only counts
+ */
+class CodeCursor {
+public:
+    CodeCursor(uint32_t* begin, size_t capacity) : begin_(begin), capacity_(capacity) {}
+
+    void push_back(uint32_t word) {
+        if (size_ < capacity_) {
+            begin_[size_] = word;
+        }
+        ++size_;
+    }
+
+    /* Sets bits of the word written before (branch and literal offsets) */
+    void patch(size_t position, uint32_t bits) {
+        assert(position < size_);
+        if (position < capacity_) {
+            begin_[position] |= bits;
+        }
+    }
+
+    size_t size() const { return size_; }
+    bool overflowed() const { return size_ > capacity_; }
+
+private:
+    uint32_t* begin_;
+    size_t capacity_;
+    size_t size_ = 0;
+};
+
+/* Compile-time checks against the words of the reference assembler */
+static_assert(!A32_ModifiedImmediate(0x101).has_value());
+static_assert(A32_ModifiedImmediate(0x104) == 0xf41u);
+static_assert(A32_RegisterRange(4, 11) == 0x0ff0u);
+
+static_assert(A32_DataProcessing(A32_OPCODE::ADD, 0, 1, A32_Operand2::Register(2)) == 0xe0810002);        //add r0, r1, r2
+static_assert(A32_DataProcessing(A32_OPCODE::ADD, 0, 0, *A32_Operand2::Immediate(1)) == 0xe2800001);      //add r0, r0, #1
+static_assert(A32_DataProcessing(A32_OPCODE::ADD, 0, 0, *A32_Operand2::Immediate(260)) == 0xe2800f41);    //add r0, r0, #260
+static_assert(A32_DataProcessing(A32_OPCODE::SUB, 1, 2, *A32_Operand2::Immediate(256)) == 0xe2421c01);    //sub r1, r2, #256
+static_assert(A32_DataProcessing(A32_OPCODE::RSB, 0, 0, *A32_Operand2::Immediate(0)) == 0xe2600000);      //rsb r0, r0, #0
+static_assert(A32_DataProcessing(A32_OPCODE::MOV, 0, 0, A32_Operand2::Register(1)) == 0xe1a00001);        //mov r0, r1
+static_assert(A32_DataProcessing(A32_OPCODE::MOV, 0, 0,
+                                 A32_Operand2::Register(1, A32_SHIFT::LSL, 2)) == 0xe1a00101);            //mov r0, r1, lsl #2
+static_assert(A32_DataProcessing(A32_OPCODE::MVN, 0, 0, *A32_Operand2::Immediate(0)) == 0xe3e00000);      //mvn r0, #0
+static_assert(A32_DataProcessing(A32_OPCODE::CMP, 0, 0, *A32_Operand2::Immediate(0)) == 0xe3500000);      //cmp r0, #0
+static_assert(A32_DataProcessing(A32_OPCODE::ADD, 0, 1,
+                                 A32_Operand2::RegisterShifted(2, A32_SHIFT::LSR, 3)) == 0xe0810332);     //add r0, r1, r2, lsr r3
+static_assert(A32_DataProcessing(A32_OPCODE::SUB, 13, 13, *A32_Operand2::Immediate(8)) == 0xe24dd008);    //sub sp, sp, #8
+static_assert(A32_DataProcessing(A32_OPCODE::ADD, 13, 13, *A32_Operand2::Immediate(8)) == 0xe28dd008);    //add sp, sp, #8
+
+static_assert(A32_Multiply(A32_OPCODE::MUL, 0, 1, 2) == 0xe0000291);        //mul r0, r1, r2
+static_assert(A32_Multiply(A32_OPCODE::MLA, 0, 1, 2, 3) == 0xe0203291);     //mla r0, r1, r2, r3
+static_assert(A32_Multiply(A32_OPCODE::MLS, 0, 1, 2, 3) == 0xe0603291);     //mls r0, r1, r2, r3
+
+static_assert(A32_LoadStore(A32_OPCODE::LDR, 0, 15, 0) == 0xe59f0000);                             //ldr r0, [pc]
+static_assert(A32_LoadStore(A32_OPCODE::LDR, 12, 13, 8) == 0xe59dc008);                            //ldr ip, [sp, #8]
+static_assert(A32_LoadStore(A32_OPCODE::STR, 12, 13, 4) == 0xe58dc004);                            //str ip, [sp, #4]
+static_assert(A32_LoadStore(A32_OPCODE::LDR, 0, 1, -4) == 0xe5110004);                             //ldr r0, [r1, #-4]
+static_assert(A32_LoadStore(A32_OPCODE::LDR, 15, 15, -4) == 0xe51ff004);                           //ldr pc, [pc, #-4]
+static_assert(A32_LoadStore(A32_OPCODE::STR, 0, 13, -4, A32_INDEX::PreIndexed) == 0xe52d0004);     //push {r0}
+static_assert(A32_LoadStore(A32_OPCODE::LDR, 0, 13, 4, A32_INDEX::PostIndexed) == 0xe49d0004);     //pop {r0}
+
+static_assert(A32_Push(A32_RegisterRange(4, 4) | 1u << 14u) == 0xe92d4010);     //push {r4, lr}
+static_assert(A32_Pop(A32_RegisterRange(4, 4) | 1u << 15u) == 0xe8bd8010);      //pop {r4, pc}
+static_assert(A32_Push(A32_RegisterRange(4, 11) | 1u << 14u) == 0xe92d4ff0);    //push {r4-r11, lr}
+static_assert(A32_Pop(A32_RegisterRange(4, 11) | 1u << 15u) == 0xe8bd8ff0);     //pop {r4-r11, pc}
+
+static_assert(A32_Branch(A32_OPCODE::B, 0) == 0xea000000);              //b .+8
+static_assert(A32_Branch(A32_OPCODE::B, -2) == 0xeafffffe);             //b .
+static_assert(A32_Branch(A32_OPCODE::BL, 0) == 0xeb000000);             //bl .+8
+static_assert(A32_BranchExchange(A32_OPCODE::BLX, 12) == 0xe12fff3c);   //blx ip
+static_assert(A32_BranchExchange(A32_OPCODE::BX, 14) == 0xe12fff1e);    //bx lr
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/* Executable memory for compiled functions
+ * Functions are carved out of large mapped regions, every page is either
+ * writable or executable (W^X). Pages written since the last commit()
+ * become executable together, so a batch of functions costs a few mprotect calls:
+ *
+ * The instruction cache is synchronized with the written code at commit(),
+ * adjacent written blocks are flushed by one call:
+ *
+ * CodeMemory memory;
+ * CodeBlock f = memory.allocate(size);   //write code to f.code
+ * CodeBlock g = memory.allocate(size);   //write code to g.code
+ * memory.commit();                       //call f.entry, g.entry
+ * memory.free(f);
+ *
+ * A page is switched back to RW only when none of its committed blocks is allocated,
+ * so allocate() never stops the functions got before, and they may be called from
+ * other threads while new ones are written. Blocks freed on pages with live code wait
+ * until the page is empty (unless the memory is dual-mapped, DualMapping).
+ * rewrite() does stop the other functions of the block pages until the next commit().
+ * Not thread-safe
+ */
+
+/* Mapping which backs the regions of code memory */
+class CodeMapping {
+public:
+    struct Region {
+        uint8_t* writable = nullptr;    //address for the writer
+        uint8_t* executable = nullptr;  //address for the calls
+        size_t size = 0;
+    };
+
+    virtual ~CodeMapping() = default;
+
+    /* Maps the region, writable part is writable at once. Empty region on failure */
+    virtual Region map(size_t size) = 0;
+    virtual void unmap(const Region& region) = 0;
+
+    /* Switches pages [writable, writable + size) between RW and RX */
+    virtual void protect(uint8_t* writable, size_t size, bool executable) = 0;
+
+    /* False if writable and executable views never need protect() */
+    virtual bool needs_protection() const { return true; }
+};
+
+/* Anonymous private mapping, one address for writing and execution */
+class PageMapping : public CodeMapping {
+public:
+    Region map(size_t size) override;
+    void unmap(const Region& region) override;
+    void protect(uint8_t* writable, size_t size, bool executable) override;
+};
+
+/* memfd mapped twice: RW for the writer and RX for the calls.
+ * Code is patched through the writable view without mprotect,
+ * no page is ever writable and executable at one address
+ */
+class DualMapping : public CodeMapping {
+public:
+    Region map(size_t size) override;
+    void unmap(const Region& region) override;
+    void protect(uint8_t* writable, size_t size, bool executable) override;
+    bool needs_protection() const override { return false; }
+};
+
+struct CodeBlock {
+    uint32_t* code = nullptr;   //writable address of the function
+    void* entry = nullptr;      //address to call
+    size_t size = 0;            //bytes available
+};
+
+struct CodeMemoryStats {
+    size_t mapped_bytes = 0;
+    size_t used_bytes = 0;      //in allocated blocks, rounded up to the size class
+    size_t map_calls = 0;
+    size_t protect_calls = 0;
+    size_t cache_flushes = 0;
+    size_t last_commit_flushes = 0;   //flushes of the last batch
+};
+
+/* Cleans the data cache and invalidates the instruction cache for [begin, end)
+ * (__clear_cache, the cacheflush syscall on ARM Linux)
+ */
+void FlushInstructionCache(void* begin, void* end);
+
+class CodeMemory {
+public:
+    explicit CodeMemory(std::unique_ptr<CodeMapping> mapping = std::make_unique<PageMapping>(),
+                        size_t region_size = 1u << 20u);
+    ~CodeMemory();
+
+    CodeMemory(const CodeMemory&) = delete;
+    CodeMemory& operator=(const CodeMemory&) = delete;
+
+    /* Writable block of at least size bytes, aligned to the cache line.
+     * Empty block if the memory can not be mapped
+     */
+    CodeBlock allocate(size_t size);
+    size_t block_size(size_t size) const;      //bytes taken by allocate(size)
+    void free(const CodeBlock& block);
+
+    /* Makes the committed block writable for patching until the next commit.
+     * Without dual mapping other functions on its pages can not be called until then
+     */
+    void rewrite(const CodeBlock& block);
+
+    /* Makes everything written since the last commit executable
+     * and visible to the instruction fetch
+     */
+    void commit();
+
+    const CodeMemoryStats& stats() const;
+
+    /* Blocks up to a page come from pages split into blocks of one size */
+    static constexpr std::array<size_t, 7> SIZE_CLASSES = {64, 128, 256, 512, 1024, 2048, 4096};
+
+private:
+    uint8_t* carve(size_t size);
+    void make_writable(uint8_t* begin, size_t size);
+    uint8_t* executable_address(uint8_t* writable) const;
+    uint8_t* page_of(const uint8_t* address) const;
+
+    std::unique_ptr<CodeMapping> mapping_;
+    size_t region_size_;
+    size_t page_size_;
+
+    std::map<uint8_t*, CodeMapping::Region> regions_ = {};     //by writable address
+    uint8_t* bump_ = nullptr;                                   //free space of the last region
+    uint8_t* bump_end_ = nullptr;
+
+    std::array<std::vector<CodeBlock>, SIZE_CLASSES.size()> free_blocks_ = {};
+    std::unordered_map<uint8_t*, size_t> page_class_ = {};     //small blocks: page -> size class
+    std::unordered_map<uint8_t*, size_t> page_live_ = {};      //small blocks: page -> allocated blocks
+    std::unordered_map<uint8_t*, size_t> large_blocks_ = {};   //large blocks: address -> size
+    std::multimap<size_t, CodeBlock> free_large_blocks_ = {};  //by size
+
+    std::unordered_map<uint8_t*, bool> is_executable_ = {};    //page -> RX or RW
+    std::vector<uint8_t*> dirty_pages_ = {};                    //written since the last commit
+    std::vector<std::pair<uint8_t*, uint8_t*>> dirty_ranges_ = {}; //executable addresses of written blocks
+
+    CodeMemoryStats stats_ = {};
+};
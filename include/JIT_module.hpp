@@ -0,0 +1,51 @@
+#pragma once
+
+#include "JIT_compiler.hpp"
+
+/* Module of compiled functions
+ * Independent expressions are compiled into one blob of separate functions int f():
+ *
+ * entry 0:   push {r4, lr}             (64-byte aligned)
+ *            bl a_helper               (call veneer)
+ *            ...
+ *            nop                       (up to the cache line)
+ * entry 1:   ldr r0, [pc, #offset]     (literal of the common pool)
+ *            ...
+ * pool:      .word 0xfb1cfcd0
+ *            ldr pc, [pc, #-4]         (veneer of a_helper, one for the module)
+ *            .word a_helper
+ *
+ * Functions share literals, symbol addresses and call veneers, the pool is placed
+ * between functions when the first ldr waiting would not reach past the next one.
+ * Calls go through veneers (call_veneers) with LITERAL addressing
+ */
+
+constexpr size_t MODULE_ALIGNMENT = 64;     //every function starts a cache line
+
+struct CodeModule {
+    CodeBlock block = {};
+    std::vector<void*> entries = {};    //addresses to call, entries[i] computes expressions[i]
+};
+
+/* Compiles into out_buffer of capacity bytes aligned to MODULE_ALIGNMENT,
+ * entry_offsets[i] is the byte offset of the function of expressions[i].
+ * If the module does not fit, status is JIT_BUFFER_TOO_SMALL and size is the capacity needed
+ */
+extern jit_emit_result_t
+jit_compile_module_to_buffer(const std::vector<std::string> & expressions,
+                             const symbol_t * externs,
+                             void * out_buffer,
+                             size_t capacity,
+                             std::vector<size_t> & entry_offsets,
+                             const CompilerOptions & options = CompilerOptions{},
+                             std::vector<CodeRelocation> * relocations = nullptr);
+
+/* Compiles into one block of the code memory. The functions can be called
+ * after memory.commit() and are released together by memory.free(module.block).
+ * Empty module if the memory can not be mapped
+ */
+extern CodeModule
+jit_compile_module(const std::vector<std::string> & expressions,
+                   const symbol_t * externs,
+                   CodeMemory & memory,
+                   const CompilerOptions & options = CompilerOptions{});
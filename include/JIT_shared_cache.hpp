@@ -0,0 +1,122 @@
+#pragma once
+
+#include "JIT_compiler.hpp"
+
+#include <atomic>
+#include <mutex>
+
+/* Cache of compiled functions shared by processes
+ * Code lives in a POSIX shared memory segment, every process attached to it
+ * calls the functions compiled by the others:
+ *
+ * SharedCodeCache cache("/jit-workers", 16u << 20u, symbols);
+ * auto f = reinterpret_cast<int (*)()>(cache.get("a * b + c"));
+ *
+ * Functions are compiled with TABLE addressing, so the shared code holds no addresses
+ * (options.variable_block is ignored, its address is of one process).
+ * Every process keeps its own relocation table for the function (addresses of its
+ * symbols in the slot order) and a thunk which passes the table in r0:
+ *
+ * add r0, pc, #4
+ * ldr pc, [pc, #-4]
+ * .word entry
+ * .word &a, &b, ...
+ *
+ * The index is an open-addressing hash table of canonical forms, published with
+ * compare-and-swap, so processes never wait for each other. A process dying
+ * in the middle of an insertion loses its record only.
+ * Segment and code space are never reclaimed: when they are full,
+ * new functions are kept in the process (not shared).
+ *
+ * Thread-safe. The segment is mapped executable, so it must not be on
+ * a noexec file system (/dev/shm is noexec on some systems)
+ */
+
+struct SharedCodeCacheStats {
+    size_t hits = 0;            //found in this process
+    size_t shared_hits = 0;     //compiled by another process
+    size_t misses = 0;          //compiled here
+    size_t published = 0;      //compiled here and added to the segment
+};
+
+class SharedCodeCache {
+public:
+    /* Bumped whenever the layout or the generated code changes */
+    static constexpr uint32_t VERSION = 1;
+
+    /* Creates the segment or attaches to the existing one.
+     * Capacity and index size of an existing segment are those of its creator
+     */
+    SharedCodeCache(const std::string& name, size_t capacity_bytes, const symbol_t* externs,
+                    CompilerOptions options = CompilerOptions{});
+    ~SharedCodeCache();
+
+    SharedCodeCache(const SharedCodeCache&) = delete;
+    SharedCodeCache& operator=(const SharedCodeCache&) = delete;
+
+    /* Removes the name, attached processes keep the segment */
+    static void Remove(const std::string& name);
+
+    /* False if the segment can not be mapped or is made with other options or version */
+    bool attached() const;
+
+    /* Entry of the function for this process, nullptr if the expression
+     * names a symbol this process does not have
+     */
+    void* get(const char* expression);
+
+    SharedCodeCacheStats stats() const;
+
+private:
+    static constexpr uint32_t MAGIC = 0x4853494a;      //"JISH"
+
+    enum SLOT_STATE : uint32_t {
+        EMPTY,
+        WRITING,        //claimed, fields are being written
+        READY
+    };
+
+    struct Header {
+        std::atomic<uint32_t> magic;    //stored last by the creator
+        uint32_t version;
+        uint32_t options;               //fingerprint of the compiler options
+        uint32_t slots;                 //power of two
+        uint32_t data_offset;           //page aligned, code is mapped executable from here
+        uint32_t data_size;
+        std::atomic<uint32_t> data_used;
+    };
+
+    /* Record in the data area: key, symbol names (each ends with '\0'), code aligned to 8 */
+    struct Slot {
+        std::atomic<uint32_t> state;
+        uint32_t hash;
+        uint32_t record;                //offset in the data area
+        uint32_t key_size;
+        uint32_t symbol_count;
+        uint32_t code;                  //offset in the data area
+        uint32_t code_size;
+    };
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared index needs lock-free atomics");
+
+    bool attach(const std::string& name, size_t capacity_bytes);
+    const Slot* find(const std::string& key, uint32_t hash) const;
+    const Slot* publish(const std::string& key, uint32_t hash, const std::vector<std::string>& symbols,
+                        const std::vector<uint32_t>& code);
+    void* bind(const uint8_t* code, const std::vector<std::string>& symbols);
+
+    const symbol_t* externs_;
+    CompilerOptions options_;
+
+    uint8_t* writable_ = nullptr;           //whole segment, RW
+    uint8_t* executable_ = nullptr;         //data area, RX
+    size_t size_ = 0;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+
+    CodeMemory local_{std::make_unique<DualMapping>()};  //thunks, functions not shared, stay RX while others bind
+    std::unordered_map<std::string, void*> spellings_ = {};     //text without spaces -> entry
+    std::unordered_map<std::string, void*> functions_ = {};     //canonical form -> entry
+    SharedCodeCacheStats stats_ = {};
+    mutable std::mutex mutex_;
+};
@@ -9,7 +9,6 @@ extern "C" {
     #include <stdlib.h>
     #include <string.h>
     #include <unistd.h>
-    #include <sys/mman.h>
 
     // available functions to be used within JIT-compiled code
     static int my_div(int a, int b) { return a / b; }
@@ -19,8 +18,7 @@ extern "C" {
 
     enum {
         SYMTABLE_SIZE = 100,  // symtable size in units
-        EXPR_SIZE = 100,      // max expression size in chars
-        CODE_SIZE = 4096      // code segment size in bytes
+        EXPR_SIZE = 100       // max expression size in chars
     };
 
     static symbol_t symbols[SYMTABLE_SIZE+1];
@@ -136,28 +134,6 @@ extern "C" {
     }
 
 
-    static void *
-    init_program_code_buffer()
-    {
-        void * result = mmap(0,
-                             CODE_SIZE,
-                             PROT_READ|PROT_WRITE|PROT_EXEC,
-                             MAP_PRIVATE|MAP_ANONYMOUS,
-                             0,
-                             0);
-        if (MAP_FAILED == result) {
-            perror("Can't mmap: ");
-            exit(2);
-        }
-        return result;
-    }
-
-    static void
-    free_program_code_buffer(void * addr)
-    {
-        munmap(addr, CODE_SIZE);
-    }
-
     static void
     call_function_and_print_result(void * addr)
     {
@@ -171,16 +147,21 @@ extern "C" {
     int main() {
         size_t functions_count = init_symbols();
         read_input(functions_count);
-        void * code_buffer = init_program_code_buffer();
+        CodeMemory code_memory;
 
-        jit_compile_expression_to_arm(expression_to_parse,
-                                      symbols,
-                                      code_buffer);
+        CodeBlock function = jit_compile_expression_to_memory(expression_to_parse,
+                                                              symbols,
+                                                              code_memory);
+        if (NULL == function.entry) {
+            perror("Can't mmap: ");
+            exit(2);
+        }
+        code_memory.commit();
 
-        call_function_and_print_result(code_buffer);
+        call_function_and_print_result(function.entry);
 
         free_symbols(functions_count);
-        free_program_code_buffer(code_buffer);
+        code_memory.free(function);
 
         return 0;
     }
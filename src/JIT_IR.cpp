@@ -0,0 +1,472 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * SSA intermediate representation and its passes
+ */
+
+#include "../include/JIT_IR.hpp"
+
+namespace {
+
+bool IsCommutative(IR_Opcode opcode) {
+    return opcode == IR_Opcode::Add || opcode == IR_Opcode::Mul;
+}
+
+const char* OpcodeName(IR_Opcode opcode) {
+    switch (opcode) {
+        case IR_Opcode::Const:
+            return "const";
+        case IR_Opcode::Address:
+            return "addr";
+        case IR_Opcode::Load:
+            return "load";
+        case IR_Opcode::Add:
+            return "add";
+        case IR_Opcode::Sub:
+            return "sub";
+        case IR_Opcode::Mul:
+            return "mul";
+        case IR_Opcode::Neg:
+            return "neg";
+        case IR_Opcode::Call:
+            return "call";
+        case IR_Opcode::Argument:
+            return "arg";
+    }
+    assert(false);
+    return "?";
+}
+
+vreg_t BuildValue(IR_Function& function, const Node* current) {
+    std::vector<vreg_t> arguments = {};
+    for (const auto& sub_expression : current->sub_expressions) {
+        arguments.push_back(BuildValue(function, sub_expression.get()));
+    }
+
+    switch (current->type) {
+        case ExpressionType::Constant:
+            return function.append(IR_Opcode::Const, IR_Type::I32, {},
+                                   static_cast<uint32_t>(std::stoul(*current->content, nullptr, 0)));
+
+        case ExpressionType::Variable: {
+            vreg_t address = function.append(IR_Opcode::Address, IR_Type::Ptr, {}, 0, *current->content);
+            return function.append(IR_Opcode::Load, IR_Type::I32, {address});
+        }
+
+        case ExpressionType::Plus:
+            return function.append(IR_Opcode::Add, IR_Type::I32, arguments);
+
+        case ExpressionType::Minus:
+            return function.append(IR_Opcode::Sub, IR_Type::I32, arguments);
+
+        case ExpressionType::Product:
+            return function.append(IR_Opcode::Mul, IR_Type::I32, arguments);
+
+        case ExpressionType::Negate:
+            return function.append(IR_Opcode::Neg, IR_Type::I32, arguments);
+
+        case ExpressionType::Function:
+            return function.append(IR_Opcode::Call, IR_Type::I32, arguments, 0, *current->content);
+
+        case ExpressionType::Argument:
+            return function.append(IR_Opcode::Argument, IR_Type::I32, {},
+                                   static_cast<uint32_t>(std::stoul(*current->content)));
+
+        default:
+            assert(false);
+            return function.append(IR_Opcode::Const, IR_Type::I32);
+    }
+}
+
+}
+
+vreg_t IR_Function::append(IR_Opcode opcode, IR_Type type, std::vector<vreg_t> arguments,
+                           uint32_t constant, std::string symbol) {
+    vreg_t result = next_register++;
+    instructions.push_back(IR_Instruction{opcode, type, result, std::move(arguments), constant, std::move(symbol)});
+    return result;
+}
+
+std::string IR_Function::dump() const {
+    std::stringstream text;
+    for (const auto& instruction : instructions) {
+        text << "%" << instruction.result << " = " << OpcodeName(instruction.opcode);
+        if (instruction.opcode == IR_Opcode::Const) {
+            text << " 0x" << std::hex << instruction.constant << std::dec;
+        }
+        if (instruction.opcode == IR_Opcode::Argument) {
+            text << " " << instruction.constant;
+        }
+        if (!instruction.symbol.empty()) {
+            text << " @" << instruction.symbol;
+        }
+
+        bool is_call = instruction.opcode == IR_Opcode::Call;
+        text << (is_call ? "(" : " ");
+        for (size_t i = 0; i < instruction.arguments.size(); ++i) {
+            text << (i > 0 ? ", %" : "%") << instruction.arguments[i];
+        }
+        text << (is_call ? ")" : "");
+        text << "\t: " << (instruction.type == IR_Type::Ptr ? "ptr" : "i32") << "\n";
+    }
+    text << "ret";
+    for (size_t i = 0; i < results.size(); ++i) {
+        text << (i > 0 ? ", %" : " %") << results[i];
+    }
+    text << "\n";
+    return text.str();
+}
+
+IR_Function BuildIR(const Node* root) {
+    /* Post-order walk of the expression tree:
+     * operands are computed before the operation, calls keep the order of the source.
+     * Results of the list are built one after another into one function
+     */
+    IR_Function function;
+    if (root->type == ExpressionType::List) {
+        for (const auto& sub_expression : root->sub_expressions) {
+            function.results.push_back(BuildValue(function, sub_expression.get()));
+        }
+    } else {
+        function.results.push_back(BuildValue(function, root));
+    }
+    return function;
+}
+
+bool ConstantFoldingPass::run(IR_Function& function) {
+    /* Instructions are rebuilt one by one. Value which turned out to be
+     * equal to another one is replaced in all instructions below.
+     * Chains with constants are kept in the form sign * x + k:
+     *
+     * %2 = sub %0, 3           %2 = sub %0, 3
+     * %4 = sub 5, %2     ->    %5 = const 8
+     *                          %4 = sub %5, %0
+     *
+     * so the first instruction becomes dead.
+     * Arithmetic is modulo 2^32 like on the target
+     */
+    std::vector<IR_Instruction> folded = {};
+    std::map<vreg_t, size_t> definition = {};       //value -> its instruction in folded
+    std::map<vreg_t, vreg_t> replaced = {};
+    bool changed = false;
+
+    auto push = [&folded, &definition](IR_Instruction instruction) {
+        definition[instruction.result] = folded.size();
+        folded.push_back(std::move(instruction));
+    };
+    auto make_constant = [&function, &push](uint32_t value) {
+        vreg_t result = function.next_register++;
+        push(IR_Instruction{IR_Opcode::Const, IR_Type::I32, result, {}, value});
+        return result;
+    };
+    auto constant = [&folded, &definition](vreg_t value) -> std::optional<uint32_t> {
+        const IR_Instruction& instruction = folded[definition.at(value)];
+        if (instruction.opcode == IR_Opcode::Const) {
+            return instruction.constant;
+        }
+        return std::nullopt;
+    };
+
+    struct Linear {
+        bool negated;
+        vreg_t base;
+        uint32_t offset;
+    };
+    auto linear = [&folded, &definition, &constant](vreg_t value) -> std::optional<Linear> {
+        /* value = (negated ? -base : base) + offset for add/sub with one constant operand */
+        const IR_Instruction& instruction = folded[definition.at(value)];
+        if (instruction.opcode != IR_Opcode::Add && instruction.opcode != IR_Opcode::Sub) {
+            return std::nullopt;
+        }
+        auto lhs = constant(instruction.arguments[0]);
+        auto rhs = constant(instruction.arguments[1]);
+        if (lhs.has_value() == rhs.has_value()) {
+            return std::nullopt;
+        }
+        if (rhs) {
+            return Linear{false, instruction.arguments[0], instruction.opcode == IR_Opcode::Add ? *rhs : -*rhs};
+        }
+        return Linear{instruction.opcode == IR_Opcode::Sub, instruction.arguments[1], *lhs};
+    };
+
+    auto cancel = [&folded, &definition](const IR_Instruction& instruction) -> std::optional<vreg_t> {
+        /* (x + y) - y -> x, (x - y) + y -> x, y + (x - y) -> x */
+        vreg_t lhs = instruction.arguments[0];
+        vreg_t rhs = instruction.arguments[1];
+        const IR_Instruction& left = folded[definition.at(lhs)];
+        const IR_Instruction& right = folded[definition.at(rhs)];
+
+        if (instruction.opcode == IR_Opcode::Sub && left.opcode == IR_Opcode::Add) {
+            if (left.arguments[1] == rhs) return left.arguments[0];
+            if (left.arguments[0] == rhs) return left.arguments[1];
+        }
+        if (instruction.opcode == IR_Opcode::Add && left.opcode == IR_Opcode::Sub && left.arguments[1] == rhs) {
+            return left.arguments[0];
+        }
+        if (instruction.opcode == IR_Opcode::Add && right.opcode == IR_Opcode::Sub && right.arguments[1] == lhs) {
+            return right.arguments[0];
+        }
+        return std::nullopt;
+    };
+
+    for (IR_Instruction instruction : function.instructions) {
+        for (auto& argument : instruction.arguments) {
+            auto replacement = replaced.find(argument);
+            if (replacement != replaced.end()) {
+                argument = replacement->second;
+            }
+        }
+
+        auto replace_with = [&replaced, &changed, &instruction](vreg_t value) {
+            replaced[instruction.result] = value;
+            changed = true;
+        };
+        auto becomes_constant = [&changed, &instruction](uint32_t value) {
+            instruction.opcode = IR_Opcode::Const;
+            instruction.arguments.clear();
+            instruction.constant = value;
+            changed = true;
+        };
+
+        std::optional<uint32_t> lhs = std::nullopt;
+        std::optional<uint32_t> rhs = std::nullopt;
+        bool is_arithmetic = instruction.opcode != IR_Opcode::Call && instruction.opcode != IR_Opcode::Load;
+        if (is_arithmetic && !instruction.arguments.empty()) {
+            lhs = constant(instruction.arguments[0]);
+        }
+        if (is_arithmetic && instruction.arguments.size() > 1) {
+            rhs = constant(instruction.arguments[1]);
+        }
+
+        switch (instruction.opcode) {
+            case IR_Opcode::Add:
+            case IR_Opcode::Sub: {
+                const IR_Instruction& subtrahend = folded[definition.at(instruction.arguments[1])];
+                if (instruction.opcode == IR_Opcode::Sub && subtrahend.opcode == IR_Opcode::Neg) {
+                    //x - (-y) -> x + y
+                    instruction.opcode = IR_Opcode::Add;
+                    instruction.arguments[1] = subtrahend.arguments[0];
+                    rhs = constant(instruction.arguments[1]);
+                    changed = true;
+                }
+                bool is_add = instruction.opcode == IR_Opcode::Add;
+                if (lhs && rhs) {
+                    becomes_constant(is_add ? *lhs + *rhs : *lhs - *rhs);
+                    break;
+                }
+                if (!is_add && instruction.arguments[0] == instruction.arguments[1]) {
+                    becomes_constant(0);
+                    break;
+                }
+                if (auto cancelled = cancel(instruction)) {
+                    replace_with(*cancelled);
+                    continue;
+                }
+                if (!lhs && !rhs) {
+                    break;
+                }
+
+                bool negated = !is_add && lhs;
+                vreg_t base = rhs ? instruction.arguments[0] : instruction.arguments[1];
+                uint32_t offset = rhs ? (is_add ? *rhs : -*rhs) : *lhs;
+                auto inner = linear(base);
+                if (inner) {
+                    offset += negated ? -inner->offset : inner->offset;
+                    negated = negated != inner->negated;
+                    base = inner->base;
+                }
+
+                if (offset == 0 && !negated) {
+                    replace_with(base);
+                    continue;
+                }
+                if (offset == 0) {
+                    instruction.opcode = IR_Opcode::Neg;
+                    instruction.arguments = {base};
+                    changed = true;
+                } else if (inner) {
+                    vreg_t offset_value = make_constant(offset);
+                    instruction.opcode = negated ? IR_Opcode::Sub : IR_Opcode::Add;
+                    instruction.arguments = negated ? std::vector<vreg_t>{offset_value, base}
+                                                    : std::vector<vreg_t>{base, offset_value};
+                    changed = true;
+                }
+                break;
+            }
+
+            case IR_Opcode::Mul: {
+                if (lhs && rhs) {
+                    becomes_constant(*lhs * *rhs);
+                    break;
+                }
+                if (!lhs && !rhs) {
+                    break;
+                }
+
+                vreg_t base = rhs ? instruction.arguments[0] : instruction.arguments[1];
+                uint32_t factor = rhs ? *rhs : *lhs;
+                const IR_Instruction& inner = folded[definition.at(base)];
+                if (inner.opcode == IR_Opcode::Mul && (constant(inner.arguments[0]) || constant(inner.arguments[1]))) {
+                    //(x * c1) * c2 -> x * (c1 * c2)
+                    bool left_constant = constant(inner.arguments[0]).has_value();
+                    factor *= *constant(inner.arguments[left_constant ? 0 : 1]);
+                    base = inner.arguments[left_constant ? 1 : 0];
+                    instruction.arguments = {base, make_constant(factor)};
+                    changed = true;
+                }
+
+                if (factor == 0) {
+                    becomes_constant(0);
+                } else if (factor == 1) {
+                    replace_with(base);
+                    continue;
+                } else if (factor == static_cast<uint32_t>(-1)) {
+                    instruction.opcode = IR_Opcode::Neg;
+                    instruction.arguments = {base};
+                    changed = true;
+                }
+                break;
+            }
+
+            case IR_Opcode::Neg: {
+                if (lhs) {
+                    becomes_constant(-*lhs);
+                    break;
+                }
+                const IR_Instruction& inner = folded[definition.at(instruction.arguments[0])];
+                if (inner.opcode == IR_Opcode::Neg) {
+                    replace_with(inner.arguments[0]);
+                    continue;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        push(std::move(instruction));
+    }
+
+    for (vreg_t& value : function.results) {
+        auto replacement = replaced.find(value);
+        if (replacement != replaced.end()) {
+            value = replacement->second;
+        }
+    }
+    function.instructions = std::move(folded);
+    return changed;
+}
+
+bool CommonSubexpressionPass::run(IR_Function& function) {
+    /* Value numbering over the straight-line code.
+     * Operands of commutative operations are sorted, so a*b and b*a are equal.
+     * Every call may write to the variables, so loads after it are new values
+     */
+    using key_t = std::tuple<IR_Opcode, std::vector<vreg_t>, uint32_t, std::string, size_t>;
+
+    std::map<key_t, vreg_t> available = {};
+    std::map<vreg_t, vreg_t> replaced = {};
+    std::vector<IR_Instruction> result = {};
+    size_t memory_epoch = 0;
+    bool changed = false;
+
+    for (IR_Instruction instruction : function.instructions) {
+        for (auto& argument : instruction.arguments) {
+            auto replacement = replaced.find(argument);
+            if (replacement != replaced.end()) {
+                argument = replacement->second;
+            }
+        }
+
+        if (instruction.opcode == IR_Opcode::Call) {
+            ++memory_epoch;
+            result.push_back(std::move(instruction));
+            continue;
+        }
+
+        std::vector<vreg_t> operands = instruction.arguments;
+        if (IsCommutative(instruction.opcode)) {
+            std::sort(operands.begin(), operands.end());
+        }
+        key_t key{instruction.opcode, operands, instruction.constant, instruction.symbol,
+                  instruction.opcode == IR_Opcode::Load ? memory_epoch : 0};
+
+        auto found = available.find(key);
+        if (found != available.end()) {
+            replaced[instruction.result] = found->second;
+            changed = true;
+            continue;
+        }
+        available.emplace(std::move(key), instruction.result);
+        result.push_back(std::move(instruction));
+    }
+
+    for (vreg_t& value : function.results) {
+        auto replacement = replaced.find(value);
+        if (replacement != replaced.end()) {
+            value = replacement->second;
+        }
+    }
+    function.instructions = std::move(result);
+    return changed;
+}
+
+bool DeadCodePass::run(IR_Function& function) {
+    std::map<vreg_t, size_t> uses = {};
+    for (vreg_t result : function.results) {
+        ++uses[result];
+    }
+    for (const auto& instruction : function.instructions) {
+        for (vreg_t argument : instruction.arguments) {
+            ++uses[argument];
+        }
+    }
+
+    std::vector<bool> alive(function.instructions.size(), true);
+    bool changed = false;
+    for (size_t i = function.instructions.size(); i > 0; --i) {
+        const IR_Instruction& instruction = function.instructions[i - 1];
+        if (instruction.opcode == IR_Opcode::Call || uses[instruction.result] > 0) {
+            continue;
+        }
+        alive[i - 1] = false;
+        changed = true;
+        for (vreg_t argument : instruction.arguments) {
+            --uses[argument];
+        }
+    }
+
+    std::vector<IR_Instruction> result = {};
+    for (size_t i = 0; i < function.instructions.size(); ++i) {
+        if (alive[i]) {
+            result.push_back(std::move(function.instructions[i]));
+        }
+    }
+    function.instructions = std::move(result);
+    return changed;
+}
+
+void IR_PassManager::add(std::unique_ptr<IR_Pass> pass) {
+    passes_.push_back(std::move(pass));
+}
+
+void IR_PassManager::run(IR_Function& function, PassManager& manager) {
+    /* Passes open opportunities for each other (cse turns a - a into %1 - %1
+     * for folding), so the pipeline is repeated while it changes anything.
+     * Passes disabled in the manager are skipped, time of every round is added up
+     */
+    constexpr size_t MAX_ROUNDS = 4;
+
+    for (size_t round = 0; round < MAX_ROUNDS; ++round) {
+        bool changed = false;
+        for (auto& pass : passes_) {
+            manager.run(pass->pass(), [&changed, &pass, &function]() {
+                changed |= pass->run(function);
+            });
+        }
+        if (!changed) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,328 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Cache of compiled functions
+ */
+
+#include "../include/JIT_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+CodeCache::CodeCache(size_t capacity_bytes, CompilerOptions options, CodeMappingFactory mapping)
+    : capacity_(capacity_bytes), options_(std::move(options)), mapping_(std::move(mapping)),
+      memory_(new_memory()) {}
+
+CodeCache::Pin::Pin(CodeCache& cache) : cache_(cache) {
+    std::lock_guard<std::mutex> lock(cache_.mutex_);
+    epoch_ = cache_.pins_.insert(cache_.epoch_);
+}
+
+CodeCache::Pin::~Pin() {
+    std::lock_guard<std::mutex> lock(cache_.mutex_);
+    cache_.pins_.erase(epoch_);
+    cache_.reclaim();
+}
+
+void* CodeCache::get(const char* expression, const symbol_t* externs) {
+    std::string key = make_key(expression, externs);
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto spelling = spellings_.find(key);
+    if (spelling != spellings_.end()) {
+        ++stats_.hits;
+        recently_used_.splice(recently_used_.begin(), recently_used_, spelling->second->age);
+        return spelling->second->block.entry;
+    }
+
+    ARM_JIT_Compiler compiler(AddressMap(externs), options_);
+    compiler.parse(expression);
+    std::string canonical = compiler.GetCanonicalForm();
+    std::string canonical_key = make_key(canonical.c_str(), externs);
+
+    auto found = entries_.find(canonical_key);
+    if (found != entries_.end()) {
+        ++stats_.hits;
+        ++stats_.canonical_hits;
+        recently_used_.splice(recently_used_.begin(), recently_used_, found->second.age);
+        found->second.spellings.push_back(key);
+        spellings_.emplace(std::move(key), &found->second);
+        return found->second.block.entry;
+    }
+
+    bool is_table = options_.addressing == SYMBOL_ADDRESSING::TABLE;
+    std::string code_key = is_table ? canonical : std::string{};
+    SharedCode* code = is_table ? &codes_[code_key] : nullptr;
+    bool is_compiled = code != nullptr && code->block.code != nullptr;
+
+    if (is_compiled) {
+        ++stats_.binding_hits;
+    } else {
+        ++stats_.misses;
+        compiler.compile();
+    }
+
+    size_t code_size = is_compiled ? 0 : compiler.GetCompiledSize();
+    std::vector<uint32_t> thunk = {};
+    if (is_table) {
+        const std::vector<std::string>& symbols = is_compiled ? code->symbols : compiler.GetSymbolSlots();
+        std::vector<void*> table = SymbolTable(symbols, externs);
+        if (std::find(table.begin(), table.end(), nullptr) != table.end()) {
+            if (code->users == 0) {
+                codes_.erase(code_key);
+            }
+            return nullptr;
+        }
+        thunk = TableThunk(nullptr, table);     //entry is written when the code is placed
+        ++code->users;                          //not retired by the evictions below
+    }
+
+    /* Blocks are charged rounded up to the size class */
+    size_t size = 0;
+    if (code_size != 0) {
+        size += memory_->block_size(code_size);
+    }
+    if (!thunk.empty()) {
+        size += memory_->block_size(thunk.size() * sizeof(uint32_t));
+    }
+    if (size > capacity_) {
+        ++stats_.rejected;
+        if (code != nullptr) {
+            release_code(code_key);
+        }
+        return nullptr;
+    }
+    while (!entries_.empty() && stats_.used_bytes + size > capacity_) {
+        evict();
+    }
+    if (evicted_since_compaction_ >= capacity_) {
+        compact_locked();
+    }
+    reclaim();
+
+    if (code_size != 0) {
+        CodeBlock block = memory_->allocate(code_size);
+        if (block.code == nullptr) {
+            if (code != nullptr) {
+                release_code(code_key);
+            }
+            return nullptr;
+        }
+        compiler.EmitCompiledBinary(block.code, block.size / sizeof(uint32_t));
+        stats_.used_bytes += block.size;
+        if (code == nullptr) {
+            memory_->commit();
+            return insert(std::move(key), std::move(canonical_key), block, {});
+        }
+        code->block = block;
+        code->symbols = compiler.GetSymbolSlots();
+    }
+
+    CodeBlock block = memory_->allocate(thunk.size() * sizeof(uint32_t));
+    if (block.code == nullptr) {
+        release_code(code_key);
+        return nullptr;
+    }
+    thunk[TABLE_THUNK_ENTRY] = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(code->block.entry));
+    std::copy(thunk.begin(), thunk.end(), block.code);
+    stats_.used_bytes += block.size;
+    memory_->commit();
+    return insert(std::move(key), std::move(canonical_key), block, std::move(code_key));
+}
+
+void* CodeCache::insert(std::string key, std::string canonical_key, const CodeBlock& block, std::string code) {
+    recently_used_.push_front(canonical_key);
+    Entry& entry = entries_.emplace(std::move(canonical_key),
+                                    Entry{block, recently_used_.begin(), {}, std::move(code)}).first->second;
+    entry.spellings.push_back(key);
+    spellings_.emplace(std::move(key), &entry);
+
+    stats_.entries = entries_.size();
+    return block.entry;
+}
+
+void CodeCache::compact() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    compact_locked();
+    reclaim();
+}
+
+CodeCacheStats CodeCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CodeCacheStats stats = stats_;
+    stats.mapped_bytes = memory_->stats().mapped_bytes;
+    for (const auto& retired : retired_memories_) {
+        stats.mapped_bytes += retired.memory->stats().mapped_bytes;
+    }
+    return stats;
+}
+
+std::unique_ptr<CodeMemory> CodeCache::new_memory() const {
+    /* Regions are not larger than the cache, so compaction frees memory in small caches too */
+    size_t region_size = std::min<size_t>(capacity_, 1u << 20u);
+    return std::make_unique<CodeMemory>(mapping_(), region_size);
+}
+
+void CodeCache::evict() {
+    /* The least recently used function leaves the cache, its block is retired.
+     * Shared code is retired with its last binding
+     */
+    auto entry = entries_.find(recently_used_.back());
+    for (const auto& spelling : entry->second.spellings) {
+        spellings_.erase(spelling);
+    }
+
+    retire(entry->second.block);
+    if (!entry->second.code.empty()) {
+        release_code(entry->second.code);
+    }
+    ++stats_.evictions;
+
+    entries_.erase(entry);
+    recently_used_.pop_back();
+    stats_.entries = entries_.size();
+}
+
+void CodeCache::retire(const CodeBlock& block) {
+    retired_.push_back({block, memory_.get(), epoch_++});
+    stats_.used_bytes -= block.size;
+    stats_.retired_bytes += block.size;
+    evicted_since_compaction_ += block.size;
+}
+
+void CodeCache::release_code(const std::string& key) {
+    auto code = codes_.find(key);
+    if (--code->second.users > 0) {
+        return;
+    }
+    if (code->second.block.code != nullptr) {
+        retire(code->second.block);
+    }
+    codes_.erase(code);
+}
+
+void CodeCache::compact_locked() {
+    /* Code does not depend on its address (literals are pc-relative, calls go
+     * through registers), so live functions are copied as they are.
+     * Thunks get the new address of the shared code.
+     * The old memory with all its regions is retired as a whole
+     */
+    std::unique_ptr<CodeMemory> fresh = new_memory();
+    std::vector<std::pair<CodeBlock*, CodeBlock>> moved = {};      //where the block is kept, its copy
+    auto move = [&fresh, &moved](CodeBlock& old) {
+        CodeBlock block = fresh->allocate(old.size);
+        if (block.code == nullptr) {
+            return false;
+        }
+        std::copy(old.code, old.code + old.size / sizeof(uint32_t), block.code);
+        moved.emplace_back(&old, block);
+        return true;
+    };
+
+    std::unordered_map<std::string, void*> code_entries = {};
+    for (auto& [key, code] : codes_) {
+        if (code.block.code == nullptr) {
+            continue;       //being compiled
+        }
+        if (!move(code.block)) {
+            return;         //old memory stays
+        }
+        code_entries[key] = moved.back().second.entry;
+    }
+    for (auto& [key, entry] : entries_) {
+        if (!move(entry.block)) {
+            return;
+        }
+        if (!entry.code.empty()) {
+            moved.back().second.code[TABLE_THUNK_ENTRY] =
+                static_cast<uint32_t>(reinterpret_cast<uintptr_t>(code_entries.at(entry.code)));
+        }
+    }
+    fresh->commit();
+
+    for (auto& [old, block] : moved) {
+        stats_.retired_bytes += old->size;
+        retired_.push_back({*old, nullptr, epoch_});
+        *old = block;
+    }
+    for (auto& retired : retired_) {
+        if (retired.memory == memory_.get()) {
+            retired.memory = nullptr;
+        }
+    }
+    retired_memories_.push_back({std::move(memory_), epoch_++});
+    memory_ = std::move(fresh);
+
+    evicted_since_compaction_ = 0;
+    ++stats_.compactions;
+}
+
+void CodeCache::reclaim() {
+    /* Pins taken at epoch e may use functions retired at epochs >= e,
+     * anything retired before the oldest pin is free
+     */
+    uint64_t oldest = pins_.empty() ? epoch_ : *pins_.begin();
+
+    auto is_free = [oldest](uint64_t epoch) {
+        return epoch < oldest;
+    };
+    for (auto& retired : retired_) {
+        if (is_free(retired.epoch)) {
+            if (retired.memory != nullptr) {
+                retired.memory->free(retired.block);
+            }
+            stats_.retired_bytes -= retired.block.size;
+        }
+    }
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [&is_free](const Retired& retired) {
+        return is_free(retired.epoch);
+    }), retired_.end());
+    retired_memories_.erase(std::remove_if(retired_memories_.begin(), retired_memories_.end(),
+                                           [&is_free](const RetiredMemory& retired) {
+        return is_free(retired.epoch);
+    }), retired_memories_.end());
+}
+
+std::string CodeCache::make_key(const char* expression, const symbol_t* externs) {
+    /* Text without spaces, then the address of every name in the order of appearance:
+     *
+     * "a*b+a" -> "a*b+a\0" &a &b &a
+     */
+    std::string text = {};
+    std::string addresses = {};
+    for (const char* current = expression; *current != '\0';) {
+        if (std::isspace(static_cast<unsigned char>(*current))) {
+            ++current;
+            continue;
+        }
+        if (std::isdigit(static_cast<unsigned char>(*current))) {
+            while (std::isalnum(static_cast<unsigned char>(*current))) {     //0x1f is not a name
+                text.push_back(*current++);
+            }
+            continue;
+        }
+        if (!std::isalpha(static_cast<unsigned char>(*current)) && *current != '_') {
+            text.push_back(*current++);
+            continue;
+        }
+
+        const char* name = current;
+        while (std::isalnum(static_cast<unsigned char>(*current)) || *current == '_') {
+            ++current;
+        }
+        auto length = static_cast<size_t>(current - name);
+        text.append(name, length);
+
+        void* address = nullptr;
+        for (const symbol_t* symbol = externs; symbol->pointer && symbol->name; ++symbol) {
+            if (std::strlen(symbol->name) == length && std::strncmp(symbol->name, name, length) == 0) {
+                address = symbol->pointer;      //the last of duplicate names, as in AddressMap
+            }
+        }
+        addresses.append(reinterpret_cast<const char*>(&address), sizeof(address));
+    }
+
+    text.push_back('\0');
+    return text + addresses;
+}
@@ -0,0 +1,274 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Compiled functions stored in a file
+ */
+
+#include "../include/JIT_cache_file.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+std::string WithoutSpaces(const char* expression) {
+    std::string text = {};
+    for (const char* current = expression; *current != '\0'; ++current) {
+        if (!std::isspace(static_cast<unsigned char>(*current))) {
+            text.push_back(*current);
+        }
+    }
+    return text;
+}
+
+const symbol_t* FindSymbol(const symbol_t* externs, const char* name) {
+    /* The last of duplicate names, as in AddressMap */
+    const symbol_t* found = nullptr;
+    for (const symbol_t* symbol = externs; symbol->pointer && symbol->name; ++symbol) {
+        if (std::strcmp(symbol->name, name) == 0) {
+            found = symbol;
+        }
+    }
+    return found;
+}
+
+} // namespace
+
+CodeCacheFile::CodeCacheFile(const std::string& path, const symbol_t* externs, CompilerOptions options)
+    : externs_(externs), options_(std::move(options)) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (!load(fd, externs)) {
+        if (mapping_ != nullptr) {
+            munmap(mapping_, mapping_size_);
+        }
+        mapping_ = nullptr;
+        entry_count_ = 0;
+    }
+    close(fd);
+}
+
+CodeCacheFile::~CodeCacheFile() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_size_);
+    }
+}
+
+bool CodeCacheFile::Write(const std::string& path, const std::vector<std::string>& expressions,
+                          const symbol_t* externs, const CompilerOptions& options) {
+    /* Layout:
+     *
+     * Header | Entry[entries] | Relocation[relocations] | strings | padding | code
+     *
+     * Equivalent spellings share the code of their canonical form,
+     * the canonical form is a key as well, for spellings not in the file.
+     * Functions are called without arguments, so symbols are relocated literals
+     */
+    assert(options.addressing == SYMBOL_ADDRESSING::LITERAL);
+    assert(!options.variable_block);    //its address is not relocated
+    std::string strings = {};
+    std::unordered_map<std::string, uint32_t> string_offsets = {};
+    auto intern = [&strings, &string_offsets](const std::string& text) {
+        auto [found, inserted] = string_offsets.emplace(text, static_cast<uint32_t>(strings.size()));
+        if (inserted) {
+            strings.append(text);
+            strings.push_back('\0');
+        }
+        return found->second;
+    };
+
+    std::vector<uint32_t> code = {};
+    std::vector<Entry> entries = {};
+    std::vector<Relocation> relocations = {};
+    std::unordered_map<std::string, std::pair<uint32_t, uint32_t>> compiled = {};  //canonical -> code, size
+    std::set<std::string> spellings = {};
+
+    for (const auto& expression : expressions) {
+        std::string spelling = WithoutSpaces(expression.c_str());
+        if (!spellings.insert(spelling).second) {
+            continue;
+        }
+
+        ARM_JIT_Compiler compiler(AddressMap(externs), options);
+        compiler.parse(expression.c_str());
+        std::string canonical = compiler.GetCanonicalForm();
+
+        auto found = compiled.find(canonical);
+        if (found == compiled.end()) {
+            compiler.compile();
+            size_t offset = code.size();
+            size_t words = compiler.GetCompiledSize() / sizeof(uint32_t);
+            code.resize(offset + words);
+
+            std::vector<CodeRelocation> code_relocations = {};
+            compiler.EmitCompiledBinary(code.data() + offset, words, &code_relocations);
+            for (const auto& relocation : code_relocations) {
+                relocations.push_back({static_cast<uint32_t>(offset * sizeof(uint32_t) + relocation.offset),
+                                       intern(relocation.symbol)});
+            }
+
+            std::pair<uint32_t, uint32_t> location = {static_cast<uint32_t>(offset * sizeof(uint32_t)),
+                                                      static_cast<uint32_t>(words * sizeof(uint32_t))};
+            found = compiled.emplace(canonical, location).first;
+            entries.push_back({1, intern(canonical), location.first, location.second});
+        }
+        entries.push_back({0, intern(spelling), found->second.first, found->second.second});
+    }
+
+    std::sort(entries.begin(), entries.end(), [&strings](const Entry& lhs, const Entry& rhs) {
+        return std::make_tuple(lhs.canonical, std::string_view(strings.data() + lhs.key)) <
+               std::make_tuple(rhs.canonical, std::string_view(strings.data() + rhs.key));
+    });
+
+    auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t tables_size = sizeof(Header) + entries.size() * sizeof(Entry) +
+                         relocations.size() * sizeof(Relocation) + strings.size();
+    size_t code_offset = (tables_size + page_size - 1) / page_size * page_size;
+
+    Header header = {MAGIC, VERSION, OptionsFingerprint(options),
+                     static_cast<uint32_t>(entries.size()), static_cast<uint32_t>(relocations.size()),
+                     static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(code_offset),
+                     static_cast<uint32_t>(code.size() * sizeof(uint32_t))};
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(entries.data()),
+                   static_cast<std::streamsize>(entries.size() * sizeof(Entry)));
+        file.write(reinterpret_cast<const char*>(relocations.data()),
+                   static_cast<std::streamsize>(relocations.size() * sizeof(Relocation)));
+        file.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+        std::string padding(code_offset - tables_size, '\0');
+        file.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+        file.write(reinterpret_cast<const char*>(code.data()),
+                   static_cast<std::streamsize>(code.size() * sizeof(uint32_t)));
+        if (!file.good()) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool CodeCacheFile::loaded() const {
+    return mapping_ != nullptr;
+}
+
+void* CodeCacheFile::get(const char* expression) const {
+    if (!loaded()) {
+        return nullptr;
+    }
+
+    void* entry = find(false, WithoutSpaces(expression));
+    if (entry != nullptr) {
+        return entry;
+    }
+
+    ARM_JIT_Compiler compiler(AddressMap(externs_), options_);
+    compiler.parse(expression);
+    return find(true, compiler.GetCanonicalForm());
+}
+
+bool CodeCacheFile::load(int fd, const symbol_t* externs) {
+    /* The file is mapped privately: relocated pages are copies of this process,
+     * the other pages stay shared with the page cache
+     */
+    struct stat status = {};
+    if (fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(Header)) {
+        return false;
+    }
+    mapping_size_ = static_cast<size_t>(status.st_size);
+    void* mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    mapping_ = static_cast<uint8_t*>(mapping);
+
+    Header header = {};
+    std::memcpy(&header, mapping_, sizeof(header));
+    if (header.magic != MAGIC || header.version != VERSION || header.options != OptionsFingerprint(options_)) {
+        return false;
+    }
+
+    auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t tables_size = sizeof(Header) + size_t{header.entries} * sizeof(Entry) +
+                         size_t{header.relocations} * sizeof(Relocation) + header.strings_size;
+    if (header.code_offset % page_size != 0 || tables_size > header.code_offset ||
+        size_t{header.code_offset} + header.code_size != mapping_size_ || header.code_size % sizeof(uint32_t) != 0 ||
+        header.strings_size == 0) {
+        return false;
+    }
+
+    entries_ = reinterpret_cast<const Entry*>(mapping_ + sizeof(Header));
+    entry_count_ = header.entries;
+    auto* relocations = reinterpret_cast<const Relocation*>(entries_ + entry_count_);
+    strings_ = reinterpret_cast<const char*>(relocations + header.relocations);
+    code_ = mapping_ + header.code_offset;
+
+    if (strings_[header.strings_size - 1] != '\0') {
+        return false;
+    }
+    for (size_t i = 0; i < entry_count_; ++i) {
+        const Entry& entry = entries_[i];
+        if (entry.key >= header.strings_size || entry.code % sizeof(uint32_t) != 0 ||
+            size_t{entry.code} + entry.size > header.code_size) {
+            return false;
+        }
+    }
+
+    /* Relocations of one symbol are resolved once */
+    std::unordered_map<uint32_t, uint32_t> addresses = {};
+    for (size_t i = 0; i < header.relocations; ++i) {
+        const Relocation& relocation = relocations[i];
+        if (relocation.symbol >= header.strings_size || relocation.offset % sizeof(uint32_t) != 0 ||
+            relocation.offset >= header.code_size) {
+            return false;
+        }
+
+        auto address = addresses.find(relocation.symbol);
+        if (address == addresses.end()) {
+            const symbol_t* symbol = FindSymbol(externs, strings_ + relocation.symbol);
+            if (symbol == nullptr) {
+                return false;
+            }
+            auto value = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(symbol->pointer));
+            address = addresses.emplace(relocation.symbol, value).first;
+        }
+        std::memcpy(code_ + relocation.offset, &address->second, sizeof(uint32_t));
+    }
+
+    if (header.code_size != 0) {
+        if (mprotect(code_, header.code_size, PROT_READ | PROT_EXEC) != 0) {
+            return false;
+        }
+        FlushInstructionCache(code_, code_ + header.code_size);
+    }
+    return true;
+}
+
+void* CodeCacheFile::find(bool canonical, std::string_view key) const {
+    /* Entries are sorted by the writer, nothing is built at load */
+    auto compare = [this](const Entry& entry, const std::pair<uint32_t, std::string_view>& target) {
+        return std::make_pair(entry.canonical, std::string_view(strings_ + entry.key)) < target;
+    };
+    std::pair<uint32_t, std::string_view> target = {canonical ? 1 : 0, key};
+    const Entry* found = std::lower_bound(entries_, entries_ + entry_count_, target, compare);
+    if (found == entries_ + entry_count_ || found->canonical != target.first ||
+        std::string_view(strings_ + found->key) != key) {
+        return nullptr;
+    }
+    return code_ + found->code;
+}
@@ -4,6 +4,7 @@
  */
 
 #include "../include/JIT_compiler.hpp"
+#include "../include/JIT_IR.hpp"
 
 /* Class constructor */
 ExpressionParser::ExpressionParser(std::string expression) : expression_(std::move(expression)) {
@@ -55,6 +56,8 @@ size_t ExpressionParser::GetPriority(ExpressionType operation) {
 }
 
 /* Finds arithmetic operation in the given subexpression.
+ * Operation is binary only if it follows an operand,
+ * so in a*-b the minus is unary and * is found.
  * If there is no any, returns {std::nullopt, 0}
  */
 auto ExpressionParser::FindArithmeticOperation(str_iter left, str_iter right)
@@ -79,19 +82,15 @@ auto ExpressionParser::FindArithmeticOperation(str_iter left, str_iter right)
             continue;
         }
 
-        if (!type) {
+        bool is_binary = current_iter != left &&
+                         GetTypeFromChar(*(current_iter - 1)) == ExpressionType::Default;
+        if (!is_binary) {
+            continue;
+        }
+
+        if (!type || GetPriority(current_type) <= GetPriority(*type)) {
             type = current_type;
             pos = current_iter;
-        } else {
-            size_t current_priority = GetPriority(current_type);
-            size_t min_priority = GetPriority(*type);
-            if (current_priority <= min_priority && *(current_iter-1) != '*') {
-                type = current_type;
-                pos = current_iter;
-            }
-            ++current_iter;
-
-            while (*current_iter == '*' || *current_iter == '-' || *current_iter == '+') ++current_iter;
         }
     }
     return std::make_pair(type, pos);
@@ -116,6 +115,8 @@ void ExpressionParser::ParseExpression(Node* current_node, str_iter left, str_it
     auto [type, pos] = FindArithmeticOperation(left, right);
     if (type) {
         ParseArithmetic(current_node, left, right, *type, pos);
+    } else if (GetTypeFromChar(*left) != ExpressionType::Default) {
+        ParseUnary(current_node, left, right);
     } else {
         if (IsConstant(left)) {
             ParseConstant(current_node, left, right);
@@ -225,15 +226,21 @@ void ExpressionParser::ParseFunction(Node *current_node, str_iter left, str_iter
     }
 }
 
-void ExpressionParser::ParseVariable(Node *current_node, str_iter left, str_iter right) {
-    if (std::distance(left, right) < 1) {
-        current_node->type = ExpressionType::Constant;
-        current_node->content = "0x0"; //In case we get -10, left constant will be void, so we make it 0-10
-    } else {
-        current_node->type = ExpressionType::Variable;
-        current_node->content = expression_.substr(std::distance(expression_.begin(), left),
-                                                   std::distance(left, right));
+void ExpressionParser::ParseUnary(Node *current_node, str_iter left, str_iter right) {
+    if (*left == '+') {
+        ParseExpression(current_node, left + 1, right);
+        return;
     }
+    current_node->type = ExpressionType::Negate;
+    current_node->content = std::nullopt;
+    current_node->sub_expressions.push_back(std::make_unique<Node>());
+    ParseExpression(current_node->sub_expressions[0].get(), left + 1, right);
+}
+
+void ExpressionParser::ParseVariable(Node *current_node, str_iter left, str_iter right) {
+    current_node->type = ExpressionType::Variable;
+    current_node->content = expression_.substr(std::distance(expression_.begin(), left),
+                                               std::distance(left, right));
 }
 
 ExpressionType ExpressionParser::GetTypeFromChar(char current_char) {
@@ -249,559 +256,1121 @@ ExpressionType ExpressionParser::GetTypeFromChar(char current_char) {
     }
 }
 
-void ARM_JIT_Compiler::compile() {
-    add_header();
-    compile_(parse_tree_.get());
-    add_footer();
+namespace {
+
+/* Nanoseconds per expression tree node for every pass.
+ * Start values are rough, every run in the thread corrects them
+ * (moving average), so the estimates follow the actual machine
+ */
+thread_local std::array<int64_t, static_cast<size_t>(COMPILER_PASS::Count)> pass_cost_per_node = {
+    300,    //parse
+    500,    //reassociate
+    700,    //build-ir
+    700,    //fold
+    900,    //cse
+    900,    //dce
+    6000,   //select
+    4000,   //regalloc
+    1500,   //schedule
+    200,    //frame
+    400     //encode
+};
+
+size_t CountNodes(const Node* current) {
+    size_t nodes = 1;
+    for (const auto& sub_expression : current->sub_expressions) {
+        nodes += CountNodes(sub_expression.get());
+    }
+    return nodes;
 }
 
-void ARM_JIT_Compiler::compile_(Node *current) {
+}
+
+namespace {
+
+std::string HexConstant(uint32_t value) {
+    std::stringstream hex_stream;
+    hex_stream << "0x" << std::hex << value;
+    return hex_stream.str();
+}
+
+void CollectCanonicalTerms(const Node* current, bool is_product, bool negated,
+                           std::vector<std::pair<const Node*, bool>>& terms) {
+    /* Terms of the +/- chain with signs, or factors of the * chain (negations are signs too) */
     switch (current->type) {
-        case ExpressionType::Constant:
-            handle_const(current);
+        case ExpressionType::Plus:
+        case ExpressionType::Minus:
+            if (is_product) {
+                break;
+            }
+            CollectCanonicalTerms(current->sub_expressions[0].get(), is_product, negated, terms);
+            CollectCanonicalTerms(current->sub_expressions[1].get(), is_product,
+                                  negated != (current->type == ExpressionType::Minus), terms);
+            return;
+
+        case ExpressionType::Product:
+            if (!is_product) {
+                break;
+            }
+            CollectCanonicalTerms(current->sub_expressions[0].get(), is_product, negated, terms);
+            CollectCanonicalTerms(current->sub_expressions[1].get(), is_product, negated, terms);
+            return;
+
+        case ExpressionType::Negate:
+            CollectCanonicalTerms(current->sub_expressions[0].get(), is_product, !negated, terms);
+            return;
+
+        default:
             break;
+    }
+    terms.emplace_back(current, negated);
+}
+
+}
+
+std::string CanonicalForm(const Node* root) {
+    switch (root->type) {
+        case ExpressionType::Constant:
+            return HexConstant(static_cast<uint32_t>(std::stoul(*root->content, nullptr, 0)));
 
         case ExpressionType::Variable:
-            handle_variable(current);
-            break;
+            return *root->content;
+
+        case ExpressionType::Argument:
+            return "$" + *root->content;
+
+        case ExpressionType::List: {
+            std::string text = {};
+            for (size_t i = 0; i < root->sub_expressions.size(); ++i) {
+                text += (i > 0 ? ";" : "") + CanonicalForm(root->sub_expressions[i].get());
+            }
+            return text;
+        }
+
+        case ExpressionType::Function: {
+            std::string text = *root->content + "(";
+            for (size_t i = 0; i < root->sub_expressions.size(); ++i) {
+                text += (i > 0 ? "," : "") + CanonicalForm(root->sub_expressions[i].get());
+            }
+            return text + ")";
+        }
 
         case ExpressionType::Plus:
-            handle_plus(current);
-            break;
+        case ExpressionType::Minus:
+        case ExpressionType::Negate:
+        case ExpressionType::Product: {
+            bool is_product = root->type == ExpressionType::Product;
+            std::vector<std::pair<const Node*, bool>> terms = {};
+            CollectCanonicalTerms(root, is_product, false, terms);
+
+            uint32_t neutral = is_product ? 1 : 0;
+            uint32_t constant = neutral;
+            std::vector<std::string> texts = {};
+            for (auto [term, negated] : terms) {
+                if (is_product && negated) {
+                    constant = -constant;
+                }
+                if (term->type == ExpressionType::Constant) {
+                    auto value = static_cast<uint32_t>(std::stoul(*term->content, nullptr, 0));
+                    if (is_product) {
+                        constant *= value;
+                    } else {
+                        constant += negated ? -value : value;
+                    }
+                    continue;
+                }
+                texts.push_back((negated && !is_product ? "-" : "") + CanonicalForm(term));
+            }
+            std::sort(texts.begin(), texts.end());
+
+            if (texts.empty()) {
+                return HexConstant(constant);
+            }
+            if (texts.size() == 1 && constant == neutral && texts[0][0] != '-') {
+                return texts[0];
+            }
+            std::string text = is_product ? "*(" : "+(";
+            for (size_t i = 0; i < texts.size(); ++i) {
+                text += (i > 0 ? "," : "") + texts[i];
+            }
+            if (constant != neutral) {
+                text += "," + HexConstant(constant);
+            }
+            return text + ")";
+        }
+
+        default:
+            assert(false);
+            return {};
+    }
+}
+
+void ARM_JIT_Compiler::parse(const std::string& expression) {
+    /* Tree size is not known yet, parsing is estimated by the length */
+    passes_.set_size(expression.size());
+    passes_.run(COMPILER_PASS::Parse, [this, &expression]() {
+        ExpressionParser parser(expression);
+        TransferParsingTree(parser, *this);
+    });
+}
+
+void ARM_JIT_Compiler::parse_function(const std::string& definition) {
+    /* f(x, y) = expression
+     * Variables named like the arguments become Argument leaves with their index
+     */
+    size_t open = definition.find('(');
+    size_t close = definition.find(')');
+    size_t equals = definition.find('=');
+    assert(open < close && close < equals && equals != std::string::npos);
+
+    std::vector<std::string> arguments = {};
+    std::string name = {};
+    for (char symbol : definition.substr(open + 1, close - open - 1)) {
+        if (symbol == ',') {
+            arguments.push_back(std::move(name));
+            name.clear();
+        } else if (symbol != ' ') {
+            name.push_back(symbol);
+        }
+    }
+    if (!name.empty() || !arguments.empty()) {
+        arguments.push_back(std::move(name));   //f() has none
+    }
+    for (size_t i = 0; i < arguments.size(); ++i) {
+        assert(!arguments[i].empty());
+        assert(std::find(arguments.begin(), arguments.begin() + i, arguments[i]) == arguments.begin() + i);
+    }
+
+    parse(definition.substr(equals + 1));
+
+    std::function<void(Node*)> mark = [&arguments, &mark](Node* current) {
+        if (current->type == ExpressionType::Variable) {
+            auto argument = std::find(arguments.begin(), arguments.end(), *current->content);
+            if (argument != arguments.end()) {
+                current->type = ExpressionType::Argument;
+                current->content = std::to_string(std::distance(arguments.begin(), argument));
+            }
+        }
+        for (auto& sub_expression : current->sub_expressions) {
+            mark(sub_expression.get());
+        }
+    };
+    mark(parse_tree_.get());
+}
+
+void ARM_JIT_Compiler::parse_list(const std::vector<std::string>& expressions) {
+    /* Trees of the expressions become subtrees of one List root */
+    assert(!expressions.empty());
+    auto list = std::make_unique<Node>();
+    list->type = ExpressionType::List;
+    for (const auto& expression : expressions) {
+        parse(expression);
+        list->sub_expressions.push_back(std::move(parse_tree_));
+    }
+    parse_tree_ = std::move(list);
+}
+
+void ARM_JIT_Compiler::compile() {
+    /* Expression tree -> SSA IR -> ARM instructions on virtual registers
+     * -> physical registers -> scheduled code with prologue and epilogue.
+     * Optional passes are run if the optimization level enables them
+     * and they fit the budget
+     */
+    passes_.set_size(CountNodes(parse_tree_.get()));
+
+    passes_.run(COMPILER_PASS::Reassociate, [this]() {
+        reassociate(parse_tree_.get());
+    });
+
+    IR_Function function;
+    passes_.run(COMPILER_PASS::BuildIR, [this, &function]() {
+        function = BuildIR(parse_tree_.get());
+    });
 
+    IR_PassManager ir_passes;
+    ir_passes.add(std::make_unique<ConstantFoldingPass>());
+    ir_passes.add(std::make_unique<CommonSubexpressionPass>());
+    ir_passes.add(std::make_unique<DeadCodePass>());
+    ir_passes.run(function, passes_);
+
+    passes_.run(COMPILER_PASS::Select, [this, &function]() {
+        lower(function);
+    });
+    passes_.run(COMPILER_PASS::RegAlloc, [this]() {
+        allocate_registers();
+    });
+    passes_.run(COMPILER_PASS::Schedule, [this]() {
+        schedule();
+    });
+    passes_.run(COMPILER_PASS::Frame, [this]() {
+        add_header();
+        add_footer();
+    });
+}
+
+void ARM_JIT_Compiler::reassociate(Node *current) {
+    /* Reassociation pass
+     * Parser gives degenerate trees for chains like a+b+c+d,
+     * so every operation waits for the previous one:
+     *
+     * (((a - b) + c) + d) + e  ->  ((a + c) + (d + e)) - b
+     *
+     * Chain of +/- is flattened into the list of terms (subtraction
+     * becomes addition of negated term), positive and negative terms
+     * are rebuilt into balanced subtrees and joined with one minus,
+     * so a - -b becomes a + b and -a + b becomes b - a.
+     * Chain of * is flattened and balanced the same way,
+     * signs of negated factors are multiplied out.
+     * Arithmetic is done modulo 2^32, so the result is exactly the same.
+     */
+
+    ExpressionType chain_type;
+    switch (current->type) {
+        case ExpressionType::Plus:
         case ExpressionType::Minus:
-            handle_minus(current);
+        case ExpressionType::Negate:
+            chain_type = ExpressionType::Plus;
             break;
-
         case ExpressionType::Product:
-            handle_product(current);
+            chain_type = ExpressionType::Product;
             break;
+        default:
+            std::for_each(current->sub_expressions.begin(),
+                          current->sub_expressions.end(),
+                          [this](const std::unique_ptr<Node>& unique_pointer) {
+                              reassociate(unique_pointer.get());
+                          });
+            return;
+    }
 
-        case ExpressionType::Function:
-            handle_function(current);
-            break;
+    std::vector<term_t> terms = {};
+    for (size_t i = 0; i < current->sub_expressions.size(); ++i) {
+        bool negated = (current->type == ExpressionType::Negate) ||
+                       (current->type == ExpressionType::Minus && i == 1);
+        collect_terms(std::move(current->sub_expressions[i]), chain_type, negated, terms);
+    }
+    current->sub_expressions.clear();
+
+    std::vector<std::unique_ptr<Node>> positive = {};
+    std::vector<std::unique_ptr<Node>> negative = {};
+    for (auto& [term, is_negated] : terms) {
+        reassociate(term.get());
+        if (term->type == ExpressionType::Negate) { //-x inside the chain only flips the sign
+            term = std::move(term->sub_expressions[0]);
+            is_negated = !is_negated;
+        }
+        (is_negated ? negative : positive).push_back(std::move(term));
+    }
 
-        case ExpressionType::Default:
-            assert(false);
+    /* Terms in canonical order: equal chains written differently
+     * get equal trees, so CSE finds them: b+c+a and a+c+b -> (a + b) + c
+     */
+    for (auto* list : {&positive, &negative}) {
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> keyed = {};
+        for (auto& term : *list) {
+            keyed.emplace_back(CanonicalForm(term.get()), std::move(term));
+        }
+        std::stable_sort(keyed.begin(), keyed.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        for (size_t i = 0; i < keyed.size(); ++i) {
+            (*list)[i] = std::move(keyed[i].second);
+        }
+    }
+
+    /* Constant terms are folded into one: a - 300 + b - 7 -> (a + b) + -307 */
+    bool is_product = chain_type == ExpressionType::Product;
+    uint32_t constant = is_product ? 1 : 0;
+    size_t constants = 0;
+    for (auto* list : {&positive, &negative}) {
+        bool is_negative = (list == &negative);
+        auto first_constant = std::stable_partition(list->begin(), list->end(), [](const std::unique_ptr<Node>& term) {
+            return term->type != ExpressionType::Constant;
+        });
+        for (auto term = first_constant; term != list->end(); ++term) {
+            auto value = static_cast<uint32_t>(std::stoul(*(*term)->content, nullptr, 0));
+            value = is_negative ? -value : value;
+            constant = is_product ? constant * value : constant + value;
+            ++constants;
+        }
+        list->erase(first_constant, list->end());
+    }
+    if (constants > 0 && (constant != (is_product ? 1u : 0u) || (positive.empty() && negative.empty()))) {
+        std::stringstream hex_stream;
+        hex_stream << std::hex << constant;
+        auto node = std::make_unique<Node>();
+        node->type = ExpressionType::Constant;
+        node->content = "0x" + hex_stream.str();
+        positive.push_back(std::move(node));
+    }
+
+    std::unique_ptr<Node> result;
+    if (chain_type == ExpressionType::Product) {
+        bool odd_negations = negative.size() % 2 == 1; //(-a)*(-b) = a*b
+        std::move(negative.begin(), negative.end(), std::back_inserter(positive));
+        result = build_balanced(positive, 0, positive.size(), chain_type);
+        if (odd_negations) {
+            result = make_negate(std::move(result));
+        }
+    } else if (negative.empty()) {
+        result = build_balanced(positive, 0, positive.size(), chain_type);
+    } else if (positive.empty()) {
+        result = make_negate(build_balanced(negative, 0, negative.size(), chain_type));
+    } else {
+        result = std::make_unique<Node>();
+        result->type = ExpressionType::Minus;
+        result->sub_expressions.push_back(build_balanced(positive, 0, positive.size(), chain_type));
+        result->sub_expressions.push_back(build_balanced(negative, 0, negative.size(), chain_type));
     }
+
+    current->type = result->type;
+    current->content = std::move(result->content);
+    current->sub_expressions = std::move(result->sub_expressions);
 }
 
-void ARM_JIT_Compiler::handle_const(Node *current) {
-    /* Handling Constant Type
-     * ARM instructions for that:
-     *
-     * ldr r0, [pc]
-     * b skip
-     * .word 0x05
-     * skip:
-     * push {r0}
-     *
-     * P.S. 0x05 is given for the example
+void ARM_JIT_Compiler::collect_terms(std::unique_ptr<Node> current, ExpressionType chain_type,
+                                     bool negated, std::vector<term_t>& terms) {
+    /* Flattens the chain of operations with chain_type into terms.
+     * Only chains of Plus may contain Minus and Negate nodes
      */
+    bool is_sign_node = current->type == ExpressionType::Minus || current->type == ExpressionType::Negate;
+    bool is_chain = (current->type == chain_type) ||
+                    (chain_type == ExpressionType::Plus && is_sign_node);
 
-    instructions_.emplace_back ( //ldr r0, [pc]
-            ARM_I::LDR_FROM_NEXT,
-            ARM_R::R0,
-            std::nullopt,
-            current->content
-    );
-
-    instructions_.emplace_back ( //.word *constant*
-            ARM_I::WORD_DECL,
-            std::nullopt,
-            std::nullopt,
-            current->content
-    );
-
-    instructions_.emplace_back ( // push {r0}
-            ARM_I::PUSH_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
-}
-
-void ARM_JIT_Compiler::handle_variable(Node *current) {
-    /* Handling Variable Type
-     * ARM instructions for that:
-     *
-     * ldr r0, [pc]
-     * b skip
-     * .word 0xfb1cfcd0
-     * skip:
-     * ldr r0, [r0]
-     * push {r0}
-     *
-     * P.S. 0xfb1cfcd0 is given for the example
+    if (!is_chain) {
+        terms.emplace_back(std::move(current), negated);
+        return;
+    }
+
+    if (current->type == ExpressionType::Negate) {
+        collect_terms(std::move(current->sub_expressions[0]), chain_type, !negated, terms);
+        return;
+    }
+
+    bool is_minus = (current->type == ExpressionType::Minus);
+    collect_terms(std::move(current->sub_expressions[0]), chain_type, negated, terms);
+    collect_terms(std::move(current->sub_expressions[1]), chain_type, negated != is_minus, terms);
+}
+
+std::unique_ptr<Node> ARM_JIT_Compiler::make_negate(std::unique_ptr<Node> operand) {
+    auto node = std::make_unique<Node>();
+    node->type = ExpressionType::Negate;
+    node->sub_expressions.push_back(std::move(operand));
+    return node;
+}
+
+std::unique_ptr<Node> ARM_JIT_Compiler::build_balanced(std::vector<std::unique_ptr<Node>>& operands,
+                                                       size_t left, size_t right, ExpressionType type) {
+    /* Builds balanced tree of operation type over operands[left:right] */
+    if (right - left == 1) {
+        return std::move(operands[left]);
+    }
+
+    size_t middle = left + (right - left) / 2;
+    auto node = std::make_unique<Node>();
+    node->type = type;
+    node->sub_expressions.push_back(build_balanced(operands, left, middle, type));
+    node->sub_expressions.push_back(build_balanced(operands, middle, right, type));
+    return node;
+}
+
+ARM_JIT_Compiler::ARM_REGISTER ARM_JIT_Compiler::new_virtual_register() {
+    /* Instruction selection puts every value to its own virtual register,
+     * allocate_registers() maps them to the physical ones
      */
+    return static_cast<ARM_R>(next_virtual_register_++);
+}
+
+bool ARM_JIT_Compiler::is_virtual(ARM_REGISTER reg) {
+    return static_cast<size_t>(reg) >= VIRTUAL_REGISTERS;
+}
 
+std::string ARM_JIT_Compiler::get_address(const std::string& name) const {
 #ifndef DEBUG
     std::stringstream address;
-    address << address_map_.at(*current->content);
-    std::string address_str = address.str();
+    address << address_map_.at(name);
+    return address.str();
 #endif
 
 #ifdef DEBUG
-    std::string address_str = "0x11111111";
+    return "0x11111111";
 #endif
+}
 
-    instructions_.emplace_back ( //ldr r0, [pc]
-            ARM_I::LDR_FROM_NEXT,
-            ARM_R::R0,
-            std::nullopt,
-            address_str
-    );
-
-    instructions_.emplace_back ( //.word *constant*
-            ARM_I::WORD_DECL,
-            std::nullopt,
-            std::nullopt,
-            address_str
-    );
-
-    instructions_.emplace_back ( //ldr r0, [r0]
-            ARM_I::LDR_REG,
-            ARM_R::R0,
-            ARM_R::R0,
-            std::nullopt
-    );
-
-    instructions_.emplace_back ( // push {r0}
-            ARM_I::PUSH_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
-}
-
-void ARM_JIT_Compiler::handle_plus(Node *current) {
-    /* Handling Plus operation
-     * ARM instructions for that:
-     *
-     * pop {r0-r1}
-     * add r0, r1, r0
-     * push {r0}
-     */
-    compile_(current->sub_expressions[0].get());
-    compile_(current->sub_expressions[1].get());
-
-    instructions_.emplace_back ( //pop {r0-r1}
-            ARM_I::POP_MULT_REG,
-            ARM_R::R0,
-            ARM_R::R1,
-            std::nullopt
-    );
-
-    instructions_.emplace_back( //add r0, r1, r0
-            ARM_I::ADD,
-            ARM_R::R0,
-            ARM_R::R1,
-            std::nullopt
-    );
-
-    instructions_.emplace_back( //push {r0}
-            ARM_I::PUSH_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
-}
-
-void ARM_JIT_Compiler::handle_minus(Node *current) {
-    /* Handling Minus operation
-     * ARM instructions for that:
-     *
-     * pop {r0-r1}
-     * sub r0, r1, r0
-     * push {r0}
-     */
-    compile_(current->sub_expressions[0].get());
-    compile_(current->sub_expressions[1].get());
-
-    instructions_.emplace_back ( //pop {r0-r1}
-            ARM_I::POP_MULT_REG,
-            ARM_R::R0,
-            ARM_R::R1,
-            std::nullopt
-    );
-
-    instructions_.emplace_back( //sub r0, r1, r0
-            ARM_I::SUB,
-            ARM_R::R0,
-            ARM_R::R1,
-            std::nullopt
-    );
-
-    instructions_.emplace_back( //push {r0}
-            ARM_I::PUSH_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
-}
-
-void ARM_JIT_Compiler::handle_product(Node *current) {
-    /* Handling Product operation
-     * ARM instructions for that:
-     *
-     * pop {r0-r1}
-     * mul r0, r1, r0
-     * push {r0}
+ARM_JIT_Compiler::ARM_JIT_Compiler(std::map<std::string, void*> address_map, CompilerOptions options)
+    : address_map_(std::move(address_map)), options_(options), passes_(options) {}
+
+A32_Operand2 ARM_JIT_Compiler::encode_op2(const instruction_t& instruction) {
+    /* Second operand: #immediate or register shifted left */
+    if (instruction.immediate) {
+        auto encoded = A32_Operand2::Immediate(*instruction.immediate);
+        assert(encoded);
+        return *encoded;
+    }
+    return A32_Operand2::Register(static_cast<uint32_t>(*instruction.reg3), A32_SHIFT::LSL, instruction.shift);
+}
+
+std::vector<uint32_t> ARM_JIT_Compiler::GetCompiledBinary() {
+    std::vector<uint32_t> binary(GetCompiledSize() / sizeof(uint32_t));
+    EmitCompiledBinary(binary.data(), binary.size());
+    return binary;
+}
+
+size_t ARM_JIT_Compiler::GetCompiledSize() const {
+    /* Bytes of the code and literal pools, the encoder only counts the words */
+    CodeCursor counter(nullptr, 0);
+    encode(counter);
+    return counter.size() * sizeof(uint32_t);
+}
+
+void ARM_JIT_Compiler::EmitToModule(CodeCursor& cursor, LiteralPool& pool, std::vector<CodeRelocation>* relocations) {
+    passes_.run(COMPILER_PASS::Encode, [this, &cursor, &pool, relocations]() {
+        encode(cursor, relocations, &pool);
+    });
+}
+
+size_t ARM_JIT_Compiler::EmitCompiledBinary(uint32_t* buffer, size_t capacity,
+                                            std::vector<CodeRelocation>* relocations) {
+    /* Writes at most capacity words, returns the number of words of the code.
+     * Literals with symbol addresses are listed in relocations
      */
+    CodeCursor cursor(buffer, capacity);
+    passes_.run(COMPILER_PASS::Encode, [this, &cursor, relocations]() {
+        encode(cursor, relocations);
+    });
+    return cursor.size();
+}
+
+std::string ARM_JIT_Compiler::GetCanonicalForm() const {
+    return CanonicalForm(parse_tree_.get());
+}
+
+const std::vector<std::string>& ARM_JIT_Compiler::GetSymbolSlots() const {
+    return symbol_slots_;
+}
+
+const PassTimings& ARM_JIT_Compiler::GetPassTimings() const {
+    return passes_.timings();
+}
+
+void LiteralPool::add_literal(size_t position, uint32_t value, const std::optional<std::string>& symbol) {
+    if (!first_literal_) {
+        first_literal_ = position;
+    }
+    pending_.emplace_back(position, entry(Entry{value, symbol, false}));
+}
 
-    compile_(current->sub_expressions[0].get());
-    compile_(current->sub_expressions[1].get());
-
-    instructions_.emplace_back( //pop {r0-r1}
-            ARM_I::POP_MULT_REG,
-            ARM_R::R0,
-            ARM_R::R1,
-            std::nullopt
-    );
-
-    instructions_.emplace_back( //mul r0, r1, r0
-            ARM_I::MUL,
-            ARM_R::R0,
-            ARM_R::R1,
-            std::nullopt
-    );
-
-    instructions_.emplace_back( //push {r0}
-            ARM_I::PUSH_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
-}
-
-void ARM_JIT_Compiler::handle_function(Node *current) {
-    /* Handling Function call
-     * ARM instructions for that:
+void LiteralPool::add_veneer(size_t position, uint32_t address, const std::string& symbol) {
+    pending_.emplace_back(position, entry(Entry{address, symbol, true}));
+}
+
+size_t LiteralPool::entry(Entry entry) {
+    auto key = std::make_tuple(entry.is_veneer, entry.value, entry.symbol);
+    auto [found, inserted] = index_.emplace(std::move(key), entries_.size());
+    if (inserted) {
+        words_ += entry.is_veneer ? 2 : 1;
+        entries_.push_back(std::move(entry));
+    }
+    return found->second;
+}
+
+bool LiteralPool::is_due(size_t position, size_t words) const {
+    return first_literal_ && (position + words + 2 + words_ - *first_literal_) * 4 >= RANGE;
+}
+
+void LiteralPool::place(CodeCursor& binary, bool branch_over, std::vector<CodeRelocation>* relocations) {
+    /* Words loaded by ldr rX, [pc, #offset] and veneers called by bl,
+     * pool in the middle of the code is jumped over:
      *
-     * pop {r0-ri}
-     * ldr r4, [pc]
      * b skip
+     * .word 0x05
      * .word 0xfb1cfcd0
-     * skip:
-     * blx r4
-     * push {r0}
+     * veneer: ldr pc, [pc, #-4]
+     * .word 0xfb1cfd00
+     * skip: ...
      */
+    if (pending_.empty()) {
+        return;
+    }
+    if (branch_over) {
+        binary.push_back(A32_Branch(A32_OPCODE::B, static_cast<int32_t>(words_) - 1));    //b skip
+    }
 
-    std::for_each(current->sub_expressions.begin(),
-                  current->sub_expressions.end(),
-                  [this](const std::unique_ptr<Node>& unique_pointer) {
-                      compile_(unique_pointer.get());
-                  });
+    std::vector<size_t> start(entries_.size());
+    size_t pool_start = binary.size();
+    for (size_t i = 0, word = pool_start; i < entries_.size(); ++i) {
+        start[i] = word;
+        word += entries_[i].is_veneer ? 2 : 1;
+    }
+    for (const auto& [position, index] : pending_) {
+        auto distance = static_cast<uint32_t>(start[index] - position - 2);
+        if (entries_[index].is_veneer) {
+            assert(distance < (1u << 23u));     //bl reaches 32 MB forward
+            binary.patch(position, distance);
+        } else {
+            binary.patch(position, distance * 4);
+        }
+    }
 
-    size_t arguments_number = current->sub_expressions.size();
-    assert(arguments_number > 0);
+    for (const auto& entry : entries_) {
+        if (entry.is_veneer) {
+            binary.push_back(A32_LoadStore(A32_OPCODE::LDR, 15, 15, -4));      //ldr pc, [pc, #-4]
+        }
+        if (relocations != nullptr && entry.symbol) {
+            relocations->push_back({binary.size() * sizeof(uint32_t), *entry.symbol});
+        }
+        binary.push_back(entry.value);
+    }
 
-    #ifndef DEBUG
+    entries_.clear();
+    index_.clear();
+    pending_.clear();
+    first_literal_ = std::nullopt;
+    words_ = 0;
+}
 
-    std::stringstream address;
-    address << address_map_.at(*current->content);
-    std::string content = address.str();
+void ARM_JIT_Compiler::encode(CodeCursor& binary, std::vector<CodeRelocation>* relocations,
+                              LiteralPool* shared_pool) const {
+    /* Literals go to the pool after the code, or to the middle of it when the first
+     * ldr waiting would not reach it. Shared pool is placed by the owner
+     */
+    LiteralPool own_pool;
+    LiteralPool& pool = shared_pool != nullptr ? *shared_pool : own_pool;
+
+    for (const auto& instruction : instructions_) {
+        uint32_t reg1 = instruction.reg1.has_value() ? static_cast<uint32_t>(*instruction.reg1) : 0;
+        uint32_t reg2 = instruction.reg2.has_value() ? static_cast<uint32_t>(*instruction.reg2) : 0;
+        uint32_t reg3 = instruction.reg3.has_value() ? static_cast<uint32_t>(*instruction.reg3) : 0;
+        uint32_t reg4 = instruction.reg4.has_value() ? static_cast<uint32_t>(*instruction.reg4) : 0;
+        auto offset = static_cast<int32_t>(instruction.immediate.value_or(0));
+
+        if (pool.is_due(binary.size(), 0)) {
+            pool.place(binary, true, relocations);
+        }
+
+        switch (instruction.type) {
+            case ARM_I::ADD:
+                binary.push_back(A32_DataProcessing(A32_OPCODE::ADD, reg1, reg2, encode_op2(instruction)));
+                break;
+
+            case ARM_I::SUB:
+                binary.push_back(A32_DataProcessing(A32_OPCODE::SUB, reg1, reg2, encode_op2(instruction)));
+                break;
+
+            case ARM_I::RSB:
+                binary.push_back(A32_DataProcessing(A32_OPCODE::RSB, reg1, reg2, encode_op2(instruction)));
+                break;
+
+            case ARM_I::MOV:
+                binary.push_back(A32_DataProcessing(A32_OPCODE::MOV, reg1, 0, encode_op2(instruction)));
+                break;
+
+            case ARM_I::MVN:
+                binary.push_back(A32_DataProcessing(A32_OPCODE::MVN, reg1, 0, encode_op2(instruction)));
+                break;
+
+            case ARM_I::MUL:
+                binary.push_back(A32_Multiply(A32_OPCODE::MUL, reg1, reg2, reg3));
+                break;
+
+            case ARM_I::MLA:
+                binary.push_back(A32_Multiply(A32_OPCODE::MLA, reg1, reg2, reg3, reg4));
+                break;
+
+            case ARM_I::MLS:
+                binary.push_back(A32_Multiply(A32_OPCODE::MLS, reg1, reg2, reg3, reg4));
+                break;
+
+            case ARM_I::BLX:
+                binary.push_back(A32_BranchExchange(A32_OPCODE::BLX, reg1));
+                break;
+
+            case ARM_I::LDR_LITERAL:
+                //offset is filled when the literal pool is placed
+                #ifdef DEBUG
+                pool.add_literal(binary.size(), 0x11111111, instruction.symbol);
+                #endif
+
+                #ifndef DEBUG
+                pool.add_literal(binary.size(), static_cast<uint32_t>(std::stoul(*instruction.content, nullptr, 0)),
+                                 instruction.symbol);
+                #endif
+
+                binary.push_back(A32_LoadStore(A32_OPCODE::LDR, reg1, static_cast<uint32_t>(ARM_R::PC), 0));
+                break;
+
+            case ARM_I::BL:
+                //offset is filled when the veneer is placed
+                #ifdef DEBUG
+                pool.add_veneer(binary.size(), 0x11111111, *instruction.symbol);
+                #endif
+
+                #ifndef DEBUG
+                pool.add_veneer(binary.size(), static_cast<uint32_t>(std::stoul(*instruction.content, nullptr, 0)),
+                                *instruction.symbol);
+                #endif
+
+                binary.push_back(A32_Branch(A32_OPCODE::BL, 0));
+                break;
+
+            case ARM_I::LDR_REG:
+                binary.push_back(A32_LoadStore(A32_OPCODE::LDR, reg1, reg2, offset));   //ldr rX, [rY, #offset]
+                break;
+
+            case ARM_I::LDM_REG: {
+                uint32_t mask = 0;
+                for (ARM_REGISTER reg : instruction.registers) {
+                    mask |= 1u << static_cast<uint32_t>(reg);
+                }
+                A32_BLOCK block = offset == 4 ? A32_BLOCK::IB : A32_BLOCK::IA;
+                binary.push_back(A32_BlockTransfer(A32_OPCODE::LDM, reg2, mask, block, false));  //ldmia rY, {...}
+                break;
+            }
 
-    #endif
+            case ARM_I::STR_REG:
+                binary.push_back(A32_LoadStore(A32_OPCODE::STR, reg1, reg2, offset));   //str rX, [rY, #offset]
+                break;
 
-    #ifdef DEBUG
+            case ARM_I::PUSH_REG:
+                binary.push_back(A32_LoadStore(A32_OPCODE::STR, reg1, static_cast<uint32_t>(ARM_R::SP), -4,
+                                               A32_INDEX::PreIndexed));     //str rX, [sp, #-4]!
+                break;
 
-    std::string content = current->content;
+            case ARM_I::POP_REG:
+                binary.push_back(A32_LoadStore(A32_OPCODE::LDR, reg1, static_cast<uint32_t>(ARM_R::SP), 4,
+                                               A32_INDEX::PostIndexed));    //ldr rX, [sp], #4
+                break;
 
-    #endif
+            case ARM_I::PUSH_MULT_REG:
+                binary.push_back(A32_Push(register_list(instruction.reg1, instruction.reg2,
+                                                        instruction.reg3)));    //push {rX-rY, rZ}
+                break;
 
-    for (int32_t i = arguments_number; i > 0; --i) {
-        instructions_.emplace_back ( //pop {r0-ri}
-                ARM_I::POP_REG,
-                static_cast<ARM_R>(static_cast<size_t>(ARM_R::R0) + i - 1),
-                std::nullopt,
-                std::nullopt
-        );
+            case ARM_I::POP_MULT_REG:
+                binary.push_back(A32_Pop(register_list(instruction.reg1, instruction.reg2,
+                                                       instruction.reg3)));     //pop {rX-rY, rZ}
+                break;
+
+            default:
+                assert(false);
+        }
     }
 
-    instructions_.emplace_back ( //ldr r0, [pc]
-            ARM_I::LDR_FROM_NEXT,
-            ARM_R::R4,
-            std::nullopt,
-            content
-    );
+    if (shared_pool == nullptr) {
+        pool.place(binary, false, relocations);
+    }
+}
 
-    instructions_.emplace_back ( //.word *constant*
-            ARM_I::WORD_DECL,
-            std::nullopt,
-            std::nullopt,
-            content
-    );
+std::string ARM_JIT_Compiler::register_name(ARM_REGISTER reg) {
+    switch (reg) {
+        case ARM_R::IP:
+            return "ip";
+        case ARM_R::SP:
+            return "sp";
+        case ARM_R::LR:
+            return "lr";
+        case ARM_R::PC:
+            return "pc";
+        default:
+            if (is_virtual(reg)) {
+                return "v" + std::to_string(static_cast<size_t>(reg) - VIRTUAL_REGISTERS);
+            }
+            return "r" + std::to_string(static_cast<int>(reg));
+    }
+}
+
+std::string ARM_JIT_Compiler::op2_text(const instruction_t& instruction) {
+    if (instruction.immediate) {
+        return "#" + std::to_string(*instruction.immediate);
+    }
+    return register_name(*instruction.reg3) +
+           (instruction.shift ? ", lsl #" + std::to_string(instruction.shift) : "");
+}
+
+void ARM_JIT_Compiler::add_header() {
+    /* Adding
+     * push {r4-rX, lr}
+     * sub sp, sp, #frame
+     * to the beginning of the code.
+     * Only used callee-saved registers are saved,
+     * the number of pushed registers is even to keep sp 8-byte aligned.
+     * Frame holds spilled values, stack arguments are above the pushed registers
+     */
+    ARM_R last = saved_register_last();
+    size_t frame = (spill_slots_ * 4 + 7) / 8 * 8;
+    size_t pushed = (static_cast<size_t>(last) - static_cast<size_t>(ARM_R::R4) + 2) * 4;
 
-    instructions_.emplace_back(
-            ARM_I::BLX,
-            ARM_R::R4,
-            std::nullopt,
-            std::nullopt
-    );
+    for (auto& instruction : instructions_) {
+        if (instruction.is_stack_argument) {
+            *instruction.immediate += frame + pushed;
+        }
+    }
 
-    instructions_.emplace_back ( // push {r0}
-            ARM_I::PUSH_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
+    if (frame > 0) {
+        instructions_.emplace(instructions_.begin(), ARM_I::SUB, ARM_R::SP, ARM_R::SP, std::nullopt,
+                              std::nullopt, frame);
+    }
+    instructions_.emplace(instructions_.begin(), ARM_I::PUSH_MULT_REG, ARM_R::R4, last, ARM_R::LR, std::nullopt);
 }
 
-ARM_JIT_Compiler::ARM_JIT_Compiler(std::map<std::string, void*> address_map) : address_map_(std::move(address_map)) {}
+void ARM_JIT_Compiler::add_footer() {
+    /* Adding
+     * add sp, sp, #frame
+     * pop {r4-rX, pc}
+     * to the end of the code, the result is already in r0
+     */
+    ARM_R last = saved_register_last();
+    size_t frame = (spill_slots_ * 4 + 7) / 8 * 8;
 
-std::vector<uint32_t> ARM_JIT_Compiler::GetCompiledBinary() {
-    std::vector<uint32_t> binary = {};
-    size_t counter = 0;
+    if (frame > 0) {
+        instructions_.emplace_back(ARM_I::ADD, ARM_R::SP, ARM_R::SP, std::nullopt, std::nullopt, frame);
+    }
+    instructions_.emplace_back(ARM_I::POP_MULT_REG, ARM_R::R4, last, ARM_R::PC, std::nullopt);
+}
 
-    //binary.push_back(0xe52de004); //push {lr}
-    //binary.push_back(0xe52d4004); //push {r4}
+ARM_JIT_Compiler::ARM_REGISTER ARM_JIT_Compiler::saved_register_last() const {
+    /* Callee-saved registers r4-r11 are saved as the range r4-rX:
+     * rX is the last one used, range is extended by one if needed
+     * to push an even number of registers together with lr
+     */
+    auto last = static_cast<size_t>(ARM_R::R4);
+    for (const auto& instruction : instructions_) {
+        for (const auto& reg : {instruction.reg1, instruction.reg2, instruction.reg3, instruction.reg4}) {
+            if (reg && *reg <= ARM_R::R11) {
+                last = std::max(last, static_cast<size_t>(*reg));
+            }
+        }
+    }
+    if ((last - static_cast<size_t>(ARM_R::R4) + 1) % 2 == 0) {
+        ++last;
+    }
+    return static_cast<ARM_R>(last);
+}
 
-    for (auto [type, reg1_o, reg2_o, str] : instructions_) {
-        uint32_t reg1 = reg1_o.has_value() ? static_cast<uint8_t>(*reg1_o) : 0;
-        uint32_t reg2 = reg2_o.has_value() ? static_cast<uint8_t>(*reg2_o) : 0;
-        uint32_t instruction = 0x0;
-        ++counter;
 
-        switch (type) {
-                case ARM_I::ADD:
-                    instruction |= reg1 << 12u; //first register
-                    instruction |= reg2 << 16u; //second register
-                    instruction |= 0u << 20u;   //S = 0
-                    instruction |= 0x4u << 21u; //prefix 0100
-                    instruction |= 0xeu << 28u; //condition 1110 -> always run
-                    binary.push_back(instruction);
-                    break;
-
-                case ARM_I::SUB:
-                    instruction |= reg1 << 12u; //first register
-                    instruction |= reg2 << 16u; //second register
-                    instruction |= 0u << 20u;   //S = 0
-                    instruction |= 0x2u << 21u; //prefix 0010
-                    instruction |= 0xeu << 28u; //condition 1110 -> always run
-                    binary.push_back(instruction);
-                    break;
-
-                case ARM_I::MUL:
-                    instruction |= reg2;        //Rm
-                    instruction |= 0x9u << 4u;  //1001 suffix
-                    instruction |= reg1 << 8u;  //Rs
-                    instruction |= reg1 << 16u; //Rd
-                    instruction |= 0xeu << 28u; //condition 1110 -> always run
-                    binary.push_back(instruction);
-                    break;
-
-                case ARM_I::BLX:
-                    if(reg1 == 4) {
-                        binary.push_back(0xe12fff34);   //blx r4
-                    } else {
-                        assert(false);
-                    }
-                    break;
-
-                case ARM_I::LDR_FROM_NEXT:
-                    //this is multiple instructions case
-                    /*  ldr r0, [pc]    -> e59f0000
-                     *  b skip          -> ea000000
-                     *  .word 0x004932  -> [word]
-                     *  skip: ...
-                     */
-
-                    if (reg1 == 0) {
-                        binary.push_back(0xe59f0000);
-                    } else {
-                        binary.push_back(0xe59f4000);
-                    }
+const char* PassName(COMPILER_PASS pass) {
+    switch (pass) {
+        case COMPILER_PASS::Parse:
+            return "parse";
+        case COMPILER_PASS::Reassociate:
+            return "reassociate";
+        case COMPILER_PASS::BuildIR:
+            return "build-ir";
+        case COMPILER_PASS::Fold:
+            return "fold";
+        case COMPILER_PASS::CSE:
+            return "cse";
+        case COMPILER_PASS::DCE:
+            return "dce";
+        case COMPILER_PASS::Select:
+            return "select";
+        case COMPILER_PASS::RegAlloc:
+            return "regalloc";
+        case COMPILER_PASS::Schedule:
+            return "schedule";
+        case COMPILER_PASS::Frame:
+            return "frame";
+        case COMPILER_PASS::Encode:
+            return "encode";
+        default:
+            assert(false);
+            return "?";
+    }
+}
 
-                    binary.push_back(0xea000000);
+std::chrono::nanoseconds PassTimings::total() const {
+    return std::accumulate(time.begin(), time.end(), std::chrono::nanoseconds(0));
+}
 
-                    #ifdef DEBUG
-                    binary.push_back(0x11111111);
-                    #endif
+uint32_t OptionsFingerprint(const CompilerOptions& options) {
+    /* The budget is not a part of it: code compiled within any budget is correct */
+    uint32_t fingerprint = static_cast<uint32_t>(options.level) | static_cast<uint32_t>(options.core) << 4u |
+                           static_cast<uint32_t>(options.addressing) << 7u;
+    for (COMPILER_PASS pass : options.disabled_passes) {
+        fingerprint |= 1u << (8u + static_cast<uint32_t>(pass));
+    }
+    if (options.variable_block) {
+        fingerprint |= 1u << 24u;   //code holds the address of the block
+    }
+    if (options.call_veneers) {
+        fingerprint |= 1u << 25u;
+    }
+    return fingerprint;
+}
 
-                    #ifndef DEBUG
-                    binary.push_back(std::stoul(*str, nullptr, 0));
-                    #endif
+PassManager::PassManager(CompilerOptions options)
+    : options_(std::move(options)), start_(std::chrono::steady_clock::now()) {}
 
-                    break;
+std::chrono::nanoseconds PassManager::elapsed() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+}
 
-                case ARM_I::LDR_REG:
-                    if (reg1 == 0) {
-                        binary.push_back(0xe5900000);   //ldr r0, [r0]
-                    } else if(reg1 == 4) {
-                        binary.push_back(0xe5944000);   //ldr r4, [r4]
-                    } else {
-                        assert(false);
-                    }
+bool PassManager::is_mandatory(COMPILER_PASS pass) {
+    switch (pass) {
+        case COMPILER_PASS::Reassociate:
+        case COMPILER_PASS::Fold:
+        case COMPILER_PASS::CSE:
+        case COMPILER_PASS::DCE:
+        case COMPILER_PASS::Schedule:
+            return false;
+        default:
+            return true;
+    }
+}
 
-                    break;
-
-                case ARM_I::PUSH_REG:
-                    switch (reg1) {
-                        case 0:
-                            binary.push_back(0xe52d0004);   //push {r0}
-                            break;
-                        case 1:
-                            binary.push_back(0xe52d1004);   //push {r1}
-                            break;
-                        case 2:
-                            binary.push_back(0xe52d2004);   //push {r2}
-                            break;
-                        case 3:
-                            binary.push_back(0xe52d3004);   //push {r3}
-                            break;
-                        case 4:
-                            binary.push_back(0xe52d4004);   //push {r4}
-                            break;
-                        case 5:
-                            binary.push_back(0xe52de004);   //push {lr}
-                            break;
-                        default:
-                            assert(false);
-                    }
-                    break;
-
-                case ARM_I::PUSH_MULT_REG:
-                    switch (reg2) {
-                        case 0:
-                            assert(false);
-                        case 1:
-                            binary.push_back(0xe92d0003);   //push {r0-r1}
-                            break;
-                        case 2:
-                            binary.push_back(0xe92d0007);   //push {r0-r2}
-                            break;
-                        case 3:
-                            binary.push_back(0xe92d000f);   //push {r0-r3}
-                            break;
-                        default:
-                            assert(false);
-                    }
-                    break;
-
-                case ARM_I::WORD_DECL:
-                    //not used - compiled in LDR_NEXT
-                    break;
-
-                case ARM_I::POP_REG:
-                    switch (reg1) {
-                        case 0:
-                            binary.push_back(0xe49d0004);   //pop {r0}
-                            break;
-                        case 1:
-                            binary.push_back(0xe49d1004);   //pop {r1}
-                            break;
-                        case 2:
-                            binary.push_back(0xe49d2004);   //pop {r2}
-                            break;
-                        case 3:
-                            binary.push_back(0xe49d3004);   //pop {r3}
-                            break;
-                        case 4:
-                            binary.push_back(0xe49d4004);   //pop {r4}
-                            break;
-                        default:
-                            assert(false);
-                    }
-                    break;
-
-                case ARM_I::POP_MULT_REG:
-                    switch (reg2) {
-                        case 0:
-                            assert(false);
-                        case 1:
-                            binary.push_back(0xe8bd0003); //pop {r0-r1}
-                            break;
-                        case 2:
-                            binary.push_back(0xe8bd0007); //pop {r0-r2}
-                            break;
-                        case 3:
-                            binary.push_back(0xe8bd000f); //pop {r0-r3}
-                            break;
-                        case 6:
-                            if(reg1 != 4) assert(false);
-                            binary.push_back(0xe8bd8010); //pop {r4-pc}
-                            break;
-                        default:
-                            assert(false);
-                    }
-                    break;
+std::chrono::nanoseconds PassManager::estimate(COMPILER_PASS pass) const {
+    return std::chrono::nanoseconds(pass_cost_per_node[static_cast<size_t>(pass)] * static_cast<int64_t>(size_));
+}
 
-                default:
-                    assert(false);
+bool PassManager::fits_budget(COMPILER_PASS pass) const {
+    if (!options_.budget || is_mandatory(pass)) {
+        return true;
+    }
+
+    std::chrono::nanoseconds needed = elapsed() + estimate(pass);
+    for (size_t i = 0; i < static_cast<size_t>(COMPILER_PASS::Count); ++i) {
+        auto other = static_cast<COMPILER_PASS>(i);
+        if (is_mandatory(other) && timings_.runs[i] == 0) {
+            needed += estimate(other);
         }
     }
+    return needed <= *options_.budget;
+}
 
-    return binary;
+void PassManager::record(COMPILER_PASS pass, std::chrono::nanoseconds time) {
+    auto index = static_cast<size_t>(pass);
+    timings_.time[index] += time;
+    ++timings_.runs[index];
+
+    if (size_ > 0) {
+        int64_t per_node = time.count() / static_cast<int64_t>(size_);
+        pass_cost_per_node[index] = (7 * pass_cost_per_node[index] + per_node) / 8;
+    }
 }
 
-void ARM_JIT_Compiler::add_header() {
-    /* Adding
-     * push {lr}
-     * push {r4}
-     * to the beginning of the code
+bool PassManager::enabled(COMPILER_PASS pass) const {
+    /* Parsing, selection, allocation and encoding are needed for any code,
+     * the other passes only improve it
      */
+    OPTIMIZATION_LEVEL level = options_.level;
+    bool is_disabled = options_.disabled_passes.count(pass) > 0;
+
+    switch (pass) {
+        case COMPILER_PASS::Reassociate:
+        case COMPILER_PASS::Schedule:
+            return !is_disabled && level >= OPTIMIZATION_LEVEL::O2;
 
-    instructions_.emplace_back(
-        ARM_I::PUSH_REG,
-        ARM_R::LR,
-        std::nullopt,
-        std::nullopt
-    );
+        case COMPILER_PASS::Fold:
+        case COMPILER_PASS::CSE:
+        case COMPILER_PASS::DCE:
+            return !is_disabled && level >= OPTIMIZATION_LEVEL::O1;
 
-    instructions_.emplace_back(
-        ARM_I::PUSH_REG,
-        ARM_R::R4,
-        std::nullopt,
-        std::nullopt
-    );
+        default:
+            return true;
+    }
 }
 
-void ARM_JIT_Compiler::add_footer() {
-    /* Adding
-     * pop  {r0}
-     * pop  {r4-pc}
-     * to the end of the code
-     */
+std::map<std::string, void*> AddressMap(const symbol_t* externs) {
+    std::map<std::string, void*> address_map = {};
+    for (const symbol_t* current = externs; current->pointer && current->name; ++current) {
+        address_map[current->name] = current->pointer;
+    }
+    return address_map;
+}
 
-    instructions_.emplace_back(
-            ARM_I::POP_REG,
-            ARM_R::R0,
-            std::nullopt,
-            std::nullopt
-    );
+std::vector<void*> SymbolTable(const std::vector<std::string>& symbol_slots, const symbol_t* externs) {
+    std::map<std::string, void*> address_map = AddressMap(externs);
+    std::vector<void*> table = {};
+    for (const auto& name : symbol_slots) {
+        auto address = address_map.find(name);
+        table.push_back(address != address_map.end() ? address->second : nullptr);
+    }
+    return table;
+}
 
-    instructions_.emplace_back(
-            ARM_I::POP_MULT_REG,
-            ARM_R::R4,
-            ARM_R::PC,
-            std::nullopt
-    );
+std::vector<uint32_t> TableThunk(const void* entry, const std::vector<void*>& table) {
+    /* r0 = pc + 8 + 4 is the first word of the table, lr is kept for the return of the code */
+    std::vector<uint32_t> thunk = {
+        A32_DataProcessing(A32_OPCODE::ADD, 0, 15, *A32_Operand2::Immediate(4)),
+        A32_LoadStore(A32_OPCODE::LDR, 15, 15, -4),
+        static_cast<uint32_t>(reinterpret_cast<uintptr_t>(entry))
+    };
+    for (void* address : table) {
+        thunk.push_back(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(address)));
+    }
+    return thunk;
 }
 
+namespace {
+
+thread_local PassTimings last_pass_timings;
+
+std::atomic<size_t> budget_hits(0);
+std::atomic<size_t> budget_misses(0);
+std::atomic<size_t> budget_skipped_passes(0);
+
+/* Parses the source (expression, function definition or list), compiles it
+ * and passes the compiler to emit, which puts the code where it is needed.
+ * Pass timings and budget counters are updated afterwards
+ */
+template<typename Parse, typename Emit>
+auto CompileAndEmit(Parse parse, const symbol_t* externs, const CompilerOptions& options, Emit emit) {
+    auto start = std::chrono::steady_clock::now();
+    ARM_JIT_Compiler compiler(AddressMap(externs), options);
+    parse(compiler);
+    compiler.compile();
+
+    auto result = emit(compiler);
+
+    last_pass_timings = compiler.GetPassTimings();
+
+    if (options.budget) {
+        bool in_time = std::chrono::steady_clock::now() - start <= *options.budget;
+        ++(in_time ? budget_hits : budget_misses);
+        budget_skipped_passes += std::accumulate(last_pass_timings.skipped.begin(),
+                                                 last_pass_timings.skipped.end(), size_t(0));
+    }
+    return result;
+}
+
+jit_emit_result_t EmitToBuffer(ARM_JIT_Compiler& compiler, void* out_buffer, size_t capacity) {
+    size_t words = compiler.EmitCompiledBinary(static_cast<uint32_t*>(out_buffer), capacity / sizeof(uint32_t));
+    size_t size = words * sizeof(uint32_t);
+    if (size > capacity) {
+        return jit_emit_result_t{JIT_BUFFER_TOO_SMALL, size};
+    }
+    FlushInstructionCache(out_buffer, static_cast<uint8_t*>(out_buffer) + size);
+    return jit_emit_result_t{JIT_OK, size};
+}
+
+CodeBlock EmitToMemory(ARM_JIT_Compiler& compiler, CodeMemory& memory) {
+    CodeBlock block = memory.allocate(compiler.GetCompiledSize());
+    if (block.code != nullptr) {
+        compiler.EmitCompiledBinary(block.code, block.size / sizeof(uint32_t));
+    }
+    return block;
+}
+
+}
 
 extern void
 jit_compile_expression_to_arm(const char * expression,
                               const symbol_t * externs,
                               void * out_buffer) {
-    std::string expression_cpp{expression};
-    std::map<std::string, void*> address_map = {};
+    jit_compile_expression_to_arm_with_options(expression, externs, out_buffer, CompilerOptions{});
+}
 
-    symbol_t* current = const_cast<symbol_t*>(externs);
-    for (;current->pointer && current->name; ++current) {
-        address_map[current->name] = current->pointer;
-    }
+extern void
+jit_compile_expression_to_arm_with_options(const char * expression,
+                                           const symbol_t * externs,
+                                           void * out_buffer,
+                                           const CompilerOptions & options) {
+    jit_compile_expression_to_arm_buffer(expression, externs, out_buffer, SIZE_MAX, options);
+}
+
+extern jit_emit_result_t
+jit_compile_expression_to_arm_buffer(const char * expression,
+                                     const symbol_t * externs,
+                                     void * out_buffer,
+                                     size_t capacity,
+                                     const CompilerOptions & options) {
+    return CompileAndEmit([expression](ARM_JIT_Compiler& compiler) { compiler.parse(expression); },
+                          externs, options, [out_buffer, capacity](ARM_JIT_Compiler& compiler) {
+        return EmitToBuffer(compiler, out_buffer, capacity);
+    });
+}
+
+extern jit_emit_result_t
+jit_compile_expression_to_pic_buffer(const char * expression,
+                                     void * out_buffer,
+                                     size_t capacity,
+                                     std::vector<std::string> & symbol_slots,
+                                     const CompilerOptions & options) {
+    static const symbol_t NO_SYMBOLS[] = {{nullptr, nullptr}};
+    CompilerOptions pic_options = options;
+    pic_options.addressing = SYMBOL_ADDRESSING::TABLE;
+    return CompileAndEmit([expression](ARM_JIT_Compiler& compiler) { compiler.parse(expression); },
+                          NO_SYMBOLS, pic_options, [out_buffer, capacity, &symbol_slots](ARM_JIT_Compiler& compiler) {
+        symbol_slots = compiler.GetSymbolSlots();
+        return EmitToBuffer(compiler, out_buffer, capacity);
+    });
+}
+
+extern CodeBlock
+jit_compile_expression_to_memory(const char * expression,
+                                 const symbol_t * externs,
+                                 CodeMemory & memory,
+                                 const CompilerOptions & options) {
+    return CompileAndEmit([expression](ARM_JIT_Compiler& compiler) { compiler.parse(expression); },
+                          externs, options, [&memory](ARM_JIT_Compiler& compiler) {
+        return EmitToMemory(compiler, memory);
+    });
+}
+
+extern jit_emit_result_t
+jit_compile_function_to_buffer(const char * definition,
+                               const symbol_t * externs,
+                               void * out_buffer,
+                               size_t capacity,
+                               const CompilerOptions & options) {
+    return CompileAndEmit([definition](ARM_JIT_Compiler& compiler) { compiler.parse_function(definition); },
+                          externs, options, [out_buffer, capacity](ARM_JIT_Compiler& compiler) {
+        return EmitToBuffer(compiler, out_buffer, capacity);
+    });
+}
+
+extern CodeBlock
+jit_compile_function_to_memory(const char * definition,
+                               const symbol_t * externs,
+                               CodeMemory & memory,
+                               const CompilerOptions & options) {
+    return CompileAndEmit([definition](ARM_JIT_Compiler& compiler) { compiler.parse_function(definition); },
+                          externs, options, [&memory](ARM_JIT_Compiler& compiler) {
+        return EmitToMemory(compiler, memory);
+    });
+}
 
-    ExpressionParser parser(expression_cpp);
-    ARM_JIT_Compiler compiler(address_map);
-    TransferParsingTree(parser, compiler);
+extern jit_emit_result_t
+jit_compile_expressions_to_buffer(const std::vector<std::string> & expressions,
+                                  const symbol_t * externs,
+                                  void * out_buffer,
+                                  size_t capacity,
+                                  const CompilerOptions & options) {
+    return CompileAndEmit([&expressions](ARM_JIT_Compiler& compiler) { compiler.parse_list(expressions); },
+                          externs, options, [out_buffer, capacity](ARM_JIT_Compiler& compiler) {
+        return EmitToBuffer(compiler, out_buffer, capacity);
+    });
+}
+
+extern CodeBlock
+jit_compile_expressions_to_memory(const std::vector<std::string> & expressions,
+                                  const symbol_t * externs,
+                                  CodeMemory & memory,
+                                  const CompilerOptions & options) {
+    return CompileAndEmit([&expressions](ARM_JIT_Compiler& compiler) { compiler.parse_list(expressions); },
+                          externs, options, [&memory](ARM_JIT_Compiler& compiler) {
+        return EmitToMemory(compiler, memory);
+    });
+}
+
+extern size_t
+jit_expression_code_size(const char * expression,
+                         const symbol_t * externs,
+                         const CompilerOptions & options) {
+    CompilerOptions exact_options = options;
+    exact_options.budget = std::nullopt;
+    ARM_JIT_Compiler compiler(AddressMap(externs), exact_options);
+    compiler.parse(expression);
     compiler.compile();
+    return compiler.GetCompiledSize();
+}
 
-    auto bin = compiler.GetCompiledBinary();
+extern PassTimings
+jit_last_pass_timings() {
+    return last_pass_timings;
+}
 
-    uint32_t* u32_buffer = static_cast<uint32_t*>(out_buffer);
-    for (size_t i = 0; i < bin.size(); ++i) {
-        *u32_buffer = bin[i];
-        ++u32_buffer;
-    }
-}
\ No newline at end of file
+extern budget_counters_t
+jit_budget_counters() {
+    return {budget_hits.load(), budget_misses.load(), budget_skipped_passes.load()};
+}
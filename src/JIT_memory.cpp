@@ -0,0 +1,300 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Executable memory manager
+ */
+
+#include "../include/JIT_memory.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001u
+#endif
+
+void FlushInstructionCache(void* begin, void* end) {
+    __builtin___clear_cache(static_cast<char*>(begin), static_cast<char*>(end));
+}
+
+CodeMapping::Region PageMapping::map(size_t size) {
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+        return {};
+    }
+    auto* address = static_cast<uint8_t*>(result);
+    return {address, address, size};
+}
+
+void PageMapping::unmap(const Region& region) {
+    munmap(region.writable, region.size);
+}
+
+void PageMapping::protect(uint8_t* writable, size_t size, bool executable) {
+    int result = mprotect(writable, size, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE);
+    assert(result == 0);
+    (void)result;
+}
+
+CodeMapping::Region DualMapping::map(size_t size) {
+    /* The file lives while it is mapped, the descriptor is not needed after mmap */
+    int fd = static_cast<int>(syscall(SYS_memfd_create, "jit-code", MFD_CLOEXEC));
+    if (fd < 0) {
+        return {};
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        return {};
+    }
+
+    void* writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* executable = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (writable == MAP_FAILED || executable == MAP_FAILED) {
+        if (writable != MAP_FAILED) {
+            munmap(writable, size);
+        }
+        if (executable != MAP_FAILED) {
+            munmap(executable, size);
+        }
+        return {};
+    }
+    return {static_cast<uint8_t*>(writable), static_cast<uint8_t*>(executable), size};
+}
+
+void DualMapping::unmap(const Region& region) {
+    munmap(region.writable, region.size);
+    munmap(region.executable, region.size);
+}
+
+void DualMapping::protect(uint8_t* /*writable*/, size_t /*size*/, bool /*executable*/) {
+    //views keep their protection
+    assert(false);
+}
+
+CodeMemory::CodeMemory(std::unique_ptr<CodeMapping> mapping, size_t region_size)
+    : mapping_(std::move(mapping)), page_size_(static_cast<size_t>(sysconf(_SC_PAGESIZE))) {
+    region_size_ = (region_size + page_size_ - 1) / page_size_ * page_size_;
+}
+
+CodeMemory::~CodeMemory() {
+    for (const auto& [address, region] : regions_) {
+        mapping_->unmap(region);
+    }
+}
+
+CodeBlock CodeMemory::allocate(size_t size) {
+    /* Small sizes are rounded up to the size class. A class without free blocks
+     * takes a new page from the region and splits it. Free blocks on pages with
+     * committed code of live blocks are skipped if the mapping needs protection:
+     * switching the page to RW would stop those functions.
+     * Larger sizes take whole pages and reuse the smallest freed block which fits
+     */
+    size = std::max<size_t>(size, 1);
+    auto size_class = std::find_if(SIZE_CLASSES.begin(), SIZE_CLASSES.end(), [size, this](size_t class_size) {
+        return size <= class_size && class_size <= page_size_;
+    });
+
+    CodeBlock block = {};
+    if (size_class != SIZE_CLASSES.end()) {
+        auto index = static_cast<size_t>(std::distance(SIZE_CLASSES.begin(), size_class));
+        std::vector<CodeBlock>& free_blocks = free_blocks_[index];
+
+        auto is_usable = [this](const CodeBlock& free_block) {
+            uint8_t* page = page_of(reinterpret_cast<uint8_t*>(free_block.code));
+            auto state = is_executable_.find(page);
+            return !mapping_->needs_protection() || state == is_executable_.end() || !state->second ||
+                   page_live_[page] == 0;
+        };
+        auto usable = std::find_if(free_blocks.rbegin(), free_blocks.rend(), is_usable);
+
+        if (usable == free_blocks.rend()) {
+            uint8_t* page = carve(page_size_);
+            if (page == nullptr) {
+                return {};
+            }
+            page_class_[page] = index;
+            for (size_t offset = page_size_; offset >= *size_class; offset -= *size_class) {
+                uint8_t* address = page + offset - *size_class;
+                free_blocks.push_back({reinterpret_cast<uint32_t*>(address), executable_address(address), *size_class});
+            }
+            usable = free_blocks.rbegin();
+        }
+
+        block = *usable;
+        free_blocks.erase(std::next(usable).base());
+        ++page_live_[page_of(reinterpret_cast<uint8_t*>(block.code))];
+    } else {
+        size_t rounded = (size + page_size_ - 1) / page_size_ * page_size_;
+        auto reused = free_large_blocks_.lower_bound(rounded);
+        if (reused != free_large_blocks_.end()) {
+            block = reused->second;
+            free_large_blocks_.erase(reused);
+            if (block.size > rounded) {
+                //the rest stays free
+                uint8_t* rest = reinterpret_cast<uint8_t*>(block.code) + rounded;
+                free_large_blocks_.emplace(block.size - rounded, CodeBlock{reinterpret_cast<uint32_t*>(rest),
+                                                                           executable_address(rest),
+                                                                           block.size - rounded});
+                block.size = rounded;
+            }
+        } else {
+            uint8_t* address = carve(rounded);
+            if (address == nullptr) {
+                return {};
+            }
+            block = {reinterpret_cast<uint32_t*>(address), executable_address(address), rounded};
+        }
+        large_blocks_[reinterpret_cast<uint8_t*>(block.code)] = block.size;
+    }
+
+    make_writable(reinterpret_cast<uint8_t*>(block.code), block.size);
+    stats_.used_bytes += block.size;
+    return block;
+}
+
+size_t CodeMemory::block_size(size_t size) const {
+    /* Size class, or whole pages for the larger sizes (as in allocate) */
+    size = std::max<size_t>(size, 1);
+    for (size_t class_size : SIZE_CLASSES) {
+        if (size <= class_size && class_size <= page_size_) {
+            return class_size;
+        }
+    }
+    return (size + page_size_ - 1) / page_size_ * page_size_;
+}
+
+void CodeMemory::free(const CodeBlock& block) {
+    auto* address = reinterpret_cast<uint8_t*>(block.code);
+    stats_.used_bytes -= block.size;
+
+    auto large = large_blocks_.find(address);
+    if (large != large_blocks_.end()) {
+        free_large_blocks_.emplace(large->second, block);
+        large_blocks_.erase(large);
+        return;
+    }
+
+    size_t index = page_class_.at(page_of(address));
+    assert(SIZE_CLASSES[index] == block.size);
+    free_blocks_[index].push_back(block);
+    --page_live_[page_of(address)];
+}
+
+void CodeMemory::rewrite(const CodeBlock& block) {
+    make_writable(reinterpret_cast<uint8_t*>(block.code), block.size);
+}
+
+void CodeMemory::commit() {
+    /* Runs of adjacent written pages are switched to RX by one call */
+    std::sort(dirty_pages_.begin(), dirty_pages_.end());
+    dirty_pages_.erase(std::unique(dirty_pages_.begin(), dirty_pages_.end()), dirty_pages_.end());
+
+    for (size_t begin = 0; begin < dirty_pages_.size();) {
+        size_t end = begin + 1;
+        while (end < dirty_pages_.size() && dirty_pages_[end] == dirty_pages_[end - 1] + page_size_) {
+            ++end;
+        }
+        if (mapping_->needs_protection()) {
+            mapping_->protect(dirty_pages_[begin], (end - begin) * page_size_, true);
+            ++stats_.protect_calls;
+        }
+        for (size_t i = begin; i < end; ++i) {
+            is_executable_[dirty_pages_[i]] = true;
+        }
+        begin = end;
+    }
+
+    dirty_pages_.clear();
+
+    /* Caches are maintained through the executable view, after it is RX.
+     * Overlapping and adjacent blocks make one range
+     */
+    std::sort(dirty_ranges_.begin(), dirty_ranges_.end());
+    stats_.last_commit_flushes = 0;
+    for (size_t begin = 0; begin < dirty_ranges_.size();) {
+        uint8_t* range_begin = dirty_ranges_[begin].first;
+        uint8_t* range_end = dirty_ranges_[begin].second;
+        size_t end = begin + 1;
+        while (end < dirty_ranges_.size() && dirty_ranges_[end].first <= range_end) {
+            range_end = std::max(range_end, dirty_ranges_[end].second);
+            ++end;
+        }
+        FlushInstructionCache(range_begin, range_end);
+        ++stats_.last_commit_flushes;
+        begin = end;
+    }
+    stats_.cache_flushes += stats_.last_commit_flushes;
+
+    dirty_ranges_.clear();
+}
+
+const CodeMemoryStats& CodeMemory::stats() const {
+    return stats_;
+}
+
+uint8_t* CodeMemory::carve(size_t size) {
+    /* Takes pages from the last region, maps a new one if they are not enough.
+     * Pages left in the last region become a free large block
+     */
+    if (bump_ == nullptr || static_cast<size_t>(bump_end_ - bump_) < size) {
+        CodeMapping::Region region = mapping_->map(std::max(size, region_size_));
+        if (region.writable == nullptr) {
+            return nullptr;
+        }
+        if (bump_ != bump_end_) {
+            auto rest = static_cast<size_t>(bump_end_ - bump_);
+            free_large_blocks_.emplace(rest, CodeBlock{reinterpret_cast<uint32_t*>(bump_), executable_address(bump_),
+                                                       rest});
+        }
+        regions_[region.writable] = region;
+        bump_ = region.writable;
+        bump_end_ = region.writable + region.size;
+        stats_.mapped_bytes += region.size;
+        ++stats_.map_calls;
+    }
+
+    uint8_t* address = bump_;
+    bump_ += size;
+    return address;
+}
+
+void CodeMemory::make_writable(uint8_t* begin, size_t size) {
+    /* Pages of the block go to the batch of the next commit.
+     * Pages made executable by a previous commit are switched back to RW
+     */
+    uint8_t* first = page_of(begin);
+    uint8_t* last = page_of(begin + size - 1);
+    uint8_t* executable = executable_address(begin);
+    dirty_ranges_.emplace_back(executable, executable + size);
+
+    bool is_executable = false;
+    for (uint8_t* page = first; page <= last; page += page_size_) {
+        auto state = is_executable_.find(page);
+        if (state != is_executable_.end() && state->second) {
+            is_executable = true;
+            state->second = false;
+        }
+        dirty_pages_.push_back(page);
+    }
+
+    if (is_executable && mapping_->needs_protection()) {
+        mapping_->protect(first, static_cast<size_t>(last - first) + page_size_, false);
+        ++stats_.protect_calls;
+    }
+}
+
+uint8_t* CodeMemory::executable_address(uint8_t* writable) const {
+    auto region = std::prev(regions_.upper_bound(writable));
+    return region->second.executable + (writable - region->second.writable);
+}
+
+uint8_t* CodeMemory::page_of(const uint8_t* address) const {
+    return reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(address) / page_size_ * page_size_);
+}
@@ -0,0 +1,110 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Module of compiled functions
+ */
+
+#include "../include/JIT_module.hpp"
+
+namespace {
+
+using Compilers = std::vector<std::unique_ptr<ARM_JIT_Compiler>>;
+
+Compilers CompileAll(const std::vector<std::string>& expressions, const symbol_t* externs,
+                     const CompilerOptions& options) {
+    CompilerOptions module_options = options;
+    module_options.call_veneers = true;
+    std::map<std::string, void*> address_map = AddressMap(externs);
+
+    Compilers compilers = {};
+    for (const auto& expression : expressions) {
+        compilers.push_back(std::make_unique<ARM_JIT_Compiler>(address_map, module_options));
+        compilers.back()->parse(expression);
+        compilers.back()->compile();
+    }
+    return compilers;
+}
+
+/* Words of every function with its own pool, more than it takes in the module */
+std::vector<size_t> CodeWords(const Compilers& compilers) {
+    std::vector<size_t> words = {};
+    for (const auto& compiler : compilers) {
+        words.push_back(compiler->GetCompiledSize() / sizeof(uint32_t));
+    }
+    return words;
+}
+
+/* Writes the functions at cache line boundaries, returns byte offsets of the entries.
+ * Only counts the words with the null cursor, the layout is the same
+ */
+std::vector<size_t> EmitModule(Compilers& compilers, const std::vector<size_t>& words, CodeCursor& cursor,
+                               std::vector<CodeRelocation>* relocations) {
+    constexpr size_t LINE_WORDS = MODULE_ALIGNMENT / sizeof(uint32_t);
+    auto padding = [&cursor]() { return (LINE_WORDS - cursor.size() % LINE_WORDS) % LINE_WORDS; };
+
+    LiteralPool pool;
+    std::vector<size_t> entries = {};
+    for (size_t i = 0; i < compilers.size(); ++i) {
+        /* Pool goes to the gap before the function if it would be placed in its middle */
+        if (pool.is_due(cursor.size(), padding() + words[i])) {
+            pool.place(cursor, false, relocations);
+        }
+        for (size_t nop = padding(); nop > 0; --nop) {
+            cursor.push_back(A32_DataProcessing(A32_OPCODE::MOV, 0, 0, A32_Operand2::Register(0)));   //mov r0, r0
+        }
+
+        entries.push_back(cursor.size() * sizeof(uint32_t));
+        compilers[i]->EmitToModule(cursor, pool, relocations);
+    }
+    pool.place(cursor, false, relocations);
+    return entries;
+}
+
+}
+
+extern jit_emit_result_t
+jit_compile_module_to_buffer(const std::vector<std::string> & expressions,
+                             const symbol_t * externs,
+                             void * out_buffer,
+                             size_t capacity,
+                             std::vector<size_t> & entry_offsets,
+                             const CompilerOptions & options,
+                             std::vector<CodeRelocation> * relocations) {
+    assert(reinterpret_cast<uintptr_t>(out_buffer) % MODULE_ALIGNMENT == 0);
+    Compilers compilers = CompileAll(expressions, externs, options);
+
+    CodeCursor cursor(static_cast<uint32_t*>(out_buffer), capacity / sizeof(uint32_t));
+    entry_offsets = EmitModule(compilers, CodeWords(compilers), cursor, relocations);
+
+    size_t size = cursor.size() * sizeof(uint32_t);
+    if (size > capacity) {
+        return jit_emit_result_t{JIT_BUFFER_TOO_SMALL, size};
+    }
+    FlushInstructionCache(out_buffer, static_cast<uint8_t*>(out_buffer) + size);
+    return jit_emit_result_t{JIT_OK, size};
+}
+
+extern CodeModule
+jit_compile_module(const std::vector<std::string> & expressions,
+                   const symbol_t * externs,
+                   CodeMemory & memory,
+                   const CompilerOptions & options) {
+    /* Blocks of the code memory are aligned to the cache line */
+    Compilers compilers = CompileAll(expressions, externs, options);
+    std::vector<size_t> words = CodeWords(compilers);
+
+    CodeCursor counter(nullptr, 0);
+    EmitModule(compilers, words, counter, nullptr);
+
+    CodeModule module = {};
+    module.block = memory.allocate(counter.size() * sizeof(uint32_t));
+    if (module.block.code == nullptr) {
+        return {};
+    }
+
+    CodeCursor cursor(module.block.code, module.block.size / sizeof(uint32_t));
+    for (size_t offset : EmitModule(compilers, words, cursor, nullptr)) {
+        module.entries.push_back(static_cast<uint8_t*>(module.block.entry) + offset);
+    }
+    return module;
+}
@@ -0,0 +1,365 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Linear scan register allocator
+ */
+
+#include "../include/JIT_compiler.hpp"
+
+void ARM_JIT_Compiler::instruction_registers(const instruction_t& instruction,
+                                             std::vector<ARM_REGISTER>& defs,
+                                             std::vector<ARM_REGISTER>& uses) {
+    /* Registers written and read by the instruction, including implicit ones */
+    auto add = [](std::vector<ARM_R>& list, const std::optional<ARM_R>& reg) {
+        if (reg) {
+            list.push_back(*reg);
+        }
+    };
+    std::optional<ARM_R> op2 = instruction.immediate ? std::nullopt : instruction.reg3;
+
+    switch (instruction.type) {
+        case ARM_I::ADD:
+        case ARM_I::SUB:
+        case ARM_I::RSB:
+            add(defs, instruction.reg1);
+            add(uses, instruction.reg2);
+            add(uses, op2);
+            break;
+
+        case ARM_I::MOV:
+        case ARM_I::MVN:
+            add(defs, instruction.reg1);
+            add(uses, op2);
+            break;
+
+        case ARM_I::MUL:
+            add(defs, instruction.reg1);
+            add(uses, instruction.reg2);
+            add(uses, instruction.reg3);
+            break;
+
+        case ARM_I::MLA:
+        case ARM_I::MLS:
+            add(defs, instruction.reg1);
+            add(uses, instruction.reg2);
+            add(uses, instruction.reg3);
+            add(uses, instruction.reg4);
+            break;
+
+        case ARM_I::BLX:
+        case ARM_I::BL:
+            //arguments in r0-r3, caller-saved registers are destroyed
+            add(uses, instruction.reg1);
+            for (ARM_R reg : {ARM_R::R0, ARM_R::R1, ARM_R::R2, ARM_R::R3}) {
+                uses.push_back(reg);
+                defs.push_back(reg);
+            }
+            defs.push_back(ARM_R::IP);
+            defs.push_back(ARM_R::LR);
+            break;
+
+        case ARM_I::LDR_LITERAL:
+            add(defs, instruction.reg1);
+            break;
+
+        case ARM_I::LDR_REG:
+            add(defs, instruction.reg1);
+            add(uses, instruction.reg2);
+            break;
+
+        case ARM_I::LDM_REG:
+            defs.insert(defs.end(), instruction.registers.begin(), instruction.registers.end());
+            add(uses, instruction.reg2);
+            break;
+
+        case ARM_I::STR_REG:
+            add(uses, instruction.reg1);
+            add(uses, instruction.reg2);
+            break;
+
+        case ARM_I::PUSH_REG:
+            add(uses, instruction.reg1);
+            uses.push_back(ARM_R::SP);
+            defs.push_back(ARM_R::SP);
+            break;
+
+        case ARM_I::POP_REG:
+            add(defs, instruction.reg1);
+            uses.push_back(ARM_R::SP);
+            defs.push_back(ARM_R::SP);
+            break;
+
+        case ARM_I::PUSH_MULT_REG:
+        case ARM_I::POP_MULT_REG:
+            //prologue and epilogue are added after allocation
+            assert(false);
+    }
+}
+
+void ARM_JIT_Compiler::allocate_registers() {
+    /* Every virtual register is defined once, so its live interval is
+     * [definition, last use] in the straight-line code. Intervals are scanned
+     * by their start and get a register which is free for the whole interval:
+     * not held by an active interval and not touched explicitly in between
+     * (call arguments, blx destroying r0-r3, ip and lr).
+     *
+     * Caller-saved r0-r3, ip, lr cost nothing, callee-saved r4-r10 cost a push
+     * in the prologue only once. Among equal ones the register released
+     * the longest time ago is taken, so the scheduler sees fewer false dependencies.
+     * Values copied to or from a physical register (call arguments and result)
+     * try to get that register first, so the copy is removed.
+     * Destinations of ldm try to get ascending registers, otherwise the ldm
+     * is split to single loads after the scan.
+     *
+     * If the registers are not enough, the scan is repeated with ip, lr and r11
+     * kept as scratch registers and the intervals ending last are spilled to the frame:
+     *
+     * ldr ip, [sp, #4]
+     * add ip, ip, r5
+     * str ip, [sp, #8]
+     */
+    struct Interval {
+        ARM_R value;
+        size_t start;
+        size_t end;
+    };
+
+    static const std::vector<ARM_R> ALL_REGISTERS = {
+        ARM_R::R0, ARM_R::R1, ARM_R::R2, ARM_R::R3, ARM_R::IP, ARM_R::LR,
+        ARM_R::R4, ARM_R::R5, ARM_R::R6, ARM_R::R7, ARM_R::R8, ARM_R::R9, ARM_R::R10
+    };
+    static const std::vector<ARM_R> SPILL_REGISTERS = {
+        ARM_R::R0, ARM_R::R1, ARM_R::R2, ARM_R::R3,
+        ARM_R::R4, ARM_R::R5, ARM_R::R6, ARM_R::R7, ARM_R::R8, ARM_R::R9, ARM_R::R10
+    };
+    static const std::array<ARM_R, 3> SCRATCH_REGISTERS = {ARM_R::IP, ARM_R::LR, ARM_R::R11};
+
+    constexpr size_t PHYSICAL = 16;
+    auto index = [](ARM_R reg) { return static_cast<size_t>(reg); };
+    auto number = [](ARM_R value) { return static_cast<size_t>(value) - VIRTUAL_REGISTERS; };
+
+    std::vector<Interval> intervals(next_virtual_register_ - VIRTUAL_REGISTERS, Interval{ARM_R::R0, 0, 0});
+    std::vector<bool> is_defined(intervals.size(), false);
+    std::vector<std::optional<ARM_R>> hints(intervals.size());  //mov between them disappears if they are equal
+    std::array<std::vector<size_t>, PHYSICAL> fixed = {};       //instructions touching the physical register
+    std::vector<std::optional<ARM_R>> follows(intervals.size());    //previous destination of the ldm
+
+    for (size_t i = 0; i < instructions_.size(); ++i) {
+        const instruction_t& instruction = instructions_[i];
+        std::vector<ARM_R> defs = {};
+        std::vector<ARM_R> uses = {};
+        instruction_registers(instruction, defs, uses);
+
+        if (instruction.type == ARM_I::MOV && !instruction.immediate && instruction.shift == 0) {
+            if (is_virtual(*instruction.reg1) && !is_virtual(*instruction.reg3)) {
+                hints[number(*instruction.reg1)] = *instruction.reg3;
+            } else if (!is_virtual(*instruction.reg1) && is_virtual(*instruction.reg3)) {
+                hints[number(*instruction.reg3)] = *instruction.reg1;
+            }
+        }
+        for (size_t k = 1; k < instruction.registers.size(); ++k) {
+            follows[number(instruction.registers[k])] = instruction.registers[k - 1];
+        }
+
+        for (ARM_R reg : uses) {
+            if (is_virtual(reg)) {
+                intervals[number(reg)].end = i;
+            } else {
+                fixed[index(reg)].push_back(i);
+            }
+        }
+        for (ARM_R reg : defs) {
+            if (is_virtual(reg)) {
+                intervals[number(reg)] = Interval{reg, i, i};
+                is_defined[number(reg)] = true;
+            } else {
+                fixed[index(reg)].push_back(i);
+            }
+        }
+    }
+
+    std::vector<const Interval*> sorted = {};
+    for (size_t i = 0; i < intervals.size(); ++i) {
+        if (is_defined[i]) {
+            sorted.push_back(&intervals[i]);
+        }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Interval* lhs, const Interval* rhs) {
+        return lhs->start < rhs->start;
+    });
+
+    auto is_blocked = [&fixed, &index](ARM_R reg, const Interval& interval) {
+        const std::vector<size_t>& touched = fixed[index(reg)];
+        auto next = std::upper_bound(touched.begin(), touched.end(), interval.start);
+        return next != touched.end() && *next < interval.end;
+    };
+    auto is_callee_saved = [](ARM_R reg) {
+        return ARM_R::R4 <= reg && reg <= ARM_R::R11;
+    };
+
+    std::vector<std::optional<ARM_R>> assignment(intervals.size());
+    std::vector<bool> spilled(intervals.size(), false);
+
+    auto scan = [&](const std::vector<ARM_R>& pool, bool allow_spills) {
+        std::vector<const Interval*> active = {};
+        std::array<bool, PHYSICAL> taken = {};
+        std::array<size_t, PHYSICAL> released = {};
+        std::array<bool, PHYSICAL> used = {};
+        std::fill(assignment.begin(), assignment.end(), std::nullopt);
+        std::fill(spilled.begin(), spilled.end(), false);
+
+        for (const Interval* current : sorted) {
+            for (auto it = active.begin(); it != active.end();) {
+                if ((*it)->end <= current->start) {
+                    ARM_R reg = *assignment[number((*it)->value)];
+                    taken[index(reg)] = false;
+                    released[index(reg)] = (*it)->end;
+                    it = active.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            std::optional<ARM_R> best = std::nullopt;
+            const std::optional<ARM_R>& hint = hints[number(current->value)];
+            const std::optional<ARM_R>& previous = follows[number(current->value)];
+            auto is_descending = [&](ARM_R reg) {
+                return previous && assignment[number(*previous)] && reg <= *assignment[number(*previous)];
+            };
+            auto cost = [&](ARM_R reg) {
+                return std::make_tuple(is_descending(reg), hint != reg, is_callee_saved(reg) && !used[index(reg)],
+                                       released[index(reg)]);
+            };
+            for (ARM_R reg : pool) {
+                if (taken[index(reg)] || is_blocked(reg, *current)) {
+                    continue;
+                }
+                if (!best || cost(reg) < cost(*best)) {
+                    best = reg;
+                }
+            }
+
+            if (best) {
+                assignment[number(current->value)] = *best;
+                taken[index(*best)] = true;
+                used[index(*best)] = true;
+                active.push_back(current);
+                continue;
+            }
+            if (!allow_spills) {
+                return false;
+            }
+
+            const Interval* victim = current;
+            for (const Interval* other : active) {
+                if (other->end > victim->end && !is_blocked(*assignment[number(other->value)], *current)) {
+                    victim = other;
+                }
+            }
+            spilled[number(victim->value)] = true;
+            if (victim != current) {
+                assignment[number(current->value)] = assignment[number(victim->value)];
+                assignment[number(victim->value)] = std::nullopt;
+                active.erase(std::find(active.begin(), active.end(), victim));
+                active.push_back(current);
+            }
+        }
+        return true;
+    };
+
+    if (!scan(ALL_REGISTERS, false)) {
+        scan(SPILL_REGISTERS, true);
+    }
+
+    std::map<ARM_R, size_t> slots = {};
+    for (size_t i = 0; i < spilled.size(); ++i) {
+        if (spilled[i]) {
+            slots.emplace(intervals[i].value, slots.size());
+        }
+    }
+    spill_slots_ = slots.size();
+    assert(spill_slots_ * 4 < 1024);    //frame size is encodable immediate
+
+    auto is_ascending = [&](const std::vector<ARM_R>& registers) {
+        for (size_t k = 0; k < registers.size(); ++k) {
+            const std::optional<ARM_R>& reg = assignment[number(registers[k])];
+            if (!reg || (k > 0 && *reg <= *assignment[number(registers[k - 1])])) {
+                return false;
+            }
+        }
+        return true;
+    };
+    std::vector<instruction_t> loads = {};
+    for (auto& instruction : instructions_) {
+        if (instruction.type != ARM_I::LDM_REG || is_ascending(instruction.registers)) {
+            loads.push_back(std::move(instruction));
+            continue;
+        }
+        //the word going to the register of the base is loaded last
+        const std::optional<ARM_R>& base = assignment[number(*instruction.reg2)];
+        std::optional<instruction_t> last = std::nullopt;
+        for (size_t k = 0; k < instruction.registers.size(); ++k) {
+            instruction_t load(ARM_I::LDR_REG, instruction.registers[k], instruction.reg2, std::nullopt, std::nullopt,
+                               *instruction.immediate + 4 * k);
+            if (base && assignment[number(instruction.registers[k])] == base) {
+                last = std::move(load);
+            } else {
+                loads.push_back(std::move(load));
+            }
+        }
+        if (last) {
+            loads.push_back(std::move(*last));
+        }
+    }
+
+    std::vector<instruction_t> allocated = {};
+    for (auto instruction : loads) {
+        std::vector<ARM_R> defs = {};
+        std::vector<ARM_R> uses = {};
+        instruction_registers(instruction, defs, uses);
+
+        std::map<ARM_R, ARM_R> scratch = {};
+        for (ARM_R reg : uses) {
+            if (slots.count(reg) > 0 && scratch.count(reg) == 0) {
+                ARM_R loaded = SCRATCH_REGISTERS.at(scratch.size());
+                scratch[reg] = loaded;
+                allocated.emplace_back(ARM_I::LDR_REG, loaded, ARM_R::SP, std::nullopt, std::nullopt,
+                                       slots.at(reg) * 4);
+            }
+        }
+        std::optional<ARM_R> stored = std::nullopt;
+        for (ARM_R reg : defs) {
+            if (slots.count(reg) > 0) {
+                scratch[reg] = SCRATCH_REGISTERS[0];    //operands are already read
+                stored = reg;
+            }
+        }
+
+        auto physical = [&scratch, &assignment, &number](std::optional<ARM_R>& reg) {
+            if (!reg || !is_virtual(*reg)) {
+                return;
+            }
+            auto in_scratch = scratch.find(*reg);
+            reg = in_scratch != scratch.end() ? in_scratch->second : *assignment[number(*reg)];
+        };
+        physical(instruction.reg1);
+        physical(instruction.reg2);
+        physical(instruction.reg3);
+        physical(instruction.reg4);
+        for (ARM_R& reg : instruction.registers) {
+            reg = *assignment[number(reg)];
+        }
+
+        bool is_copy_to_itself = instruction.type == ARM_I::MOV && !instruction.immediate &&
+                                 instruction.shift == 0 && instruction.reg1 == instruction.reg3;
+        if (!is_copy_to_itself) {
+            allocated.push_back(std::move(instruction));
+        }
+        if (stored) {
+            allocated.emplace_back(ARM_I::STR_REG, SCRATCH_REGISTERS[0], ARM_R::SP, std::nullopt, std::nullopt,
+                                   slots.at(*stored) * 4);
+        }
+    }
+
+    instructions_ = std::move(allocated);
+}
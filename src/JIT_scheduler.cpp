@@ -0,0 +1,230 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * List scheduler for the generated instructions
+ */
+
+#include "../include/JIT_compiler.hpp"
+
+namespace {
+
+/* Cycles from issue of the instruction until its result can be used */
+struct CoreLatencies {
+    size_t alu;         //add, sub, rsb, mov
+    size_t multiply;    //mul, mla, mls
+    size_t load;        //ldr from memory, pop
+    size_t literal;     //ldr from the literal pool
+    size_t call;        //blx: r0 is ready after the function returns
+    size_t issue_width; //instructions issued per cycle
+};
+
+/* Numbers are taken from the Technical Reference Manuals (AArch32 state) */
+CoreLatencies GetLatencies(ARM_CORE core) {
+    switch (core) {
+        case ARM_CORE::Cortex_A7:
+            return {1, 3, 3, 3, 1, 2};
+        case ARM_CORE::Cortex_A9:
+            return {1, 4, 4, 4, 1, 2};
+        case ARM_CORE::Cortex_A53:
+            return {1, 3, 3, 3, 1, 2};
+    }
+    assert(false);
+    return {1, 3, 3, 3, 1, 2};
+}
+
+constexpr uint32_t MEMORY = 1u << 16u;      //global memory: variables and anything callee touches
+
+}
+
+void ARM_JIT_Compiler::schedule() {
+    /* Instructions are reordered so that independent work
+     * fills the cycles while loads and multiplications are in flight:
+     *
+     * ldr r4, [r4]             ldr r4, [r4]
+     * add r4, r4, r5     ->    ldr r6, [r6]
+     * ldr r6, [r6]             add r4, r4, r5
+     *
+     * Dependency graph is built from registers read and written
+     * (plus global memory and sp), every cycle the ready instruction
+     * with the longest path to the end is issued.
+     */
+    CoreLatencies latencies = GetLatencies(options_.core);
+
+    auto reg_bit = [](const std::optional<ARM_REGISTER>& reg) -> uint32_t {
+        return reg ? 1u << static_cast<uint32_t>(*reg) : 0u;
+    };
+
+    struct Unit {
+        uint32_t defs = 0;
+        uint32_t uses = 0;
+        size_t latency = 1;
+        bool is_memory = false;
+        bool is_multiply = false;
+        bool is_call = false;
+
+        std::vector<std::pair<size_t, size_t>> successors = {}; //unit index and latency
+        size_t predecessors = 0;
+        size_t priority = 0;
+        size_t ready_cycle = 0;
+    };
+
+    std::vector<Unit> units = {};
+    for (const auto& instruction : instructions_) {
+        Unit unit;
+        uint32_t sp = reg_bit(ARM_R::SP);
+        uint32_t op2 = instruction.immediate ? 0u : reg_bit(instruction.reg3);
+
+        switch (instruction.type) {
+            case ARM_I::MUL:
+                unit.is_multiply = true;
+                unit.latency = latencies.multiply;
+                unit.defs = reg_bit(instruction.reg1);
+                unit.uses = reg_bit(instruction.reg2) | reg_bit(instruction.reg3);
+                break;
+
+            case ARM_I::MLA:
+            case ARM_I::MLS:
+                unit.is_multiply = true;
+                unit.latency = latencies.multiply;
+                unit.defs = reg_bit(instruction.reg1);
+                unit.uses = reg_bit(instruction.reg2) | reg_bit(instruction.reg3) | reg_bit(instruction.reg4);
+                break;
+
+            case ARM_I::BLX:
+            case ARM_I::BL:
+                unit.is_call = true;
+                unit.latency = latencies.call;
+                unit.defs = 0xfu | reg_bit(ARM_R::IP) | reg_bit(ARM_R::LR) | MEMORY;
+                unit.uses = 0xfu | reg_bit(instruction.reg1) | sp | MEMORY;
+                break;
+
+            case ARM_I::LDR_LITERAL:
+                unit.latency = latencies.literal;
+                unit.is_memory = true;
+                unit.defs = reg_bit(instruction.reg1);
+                break;
+
+            case ARM_I::LDR_REG:
+                unit.latency = latencies.load;
+                unit.is_memory = true;
+                unit.defs = reg_bit(instruction.reg1);
+                unit.uses = reg_bit(instruction.reg2) | MEMORY;
+                break;
+
+            case ARM_I::LDM_REG:
+                //two words per cycle
+                unit.latency = latencies.load + (instruction.registers.size() - 1) / 2;
+                unit.is_memory = true;
+                for (ARM_REGISTER reg : instruction.registers) {
+                    unit.defs |= reg_bit(reg);
+                }
+                unit.uses = reg_bit(instruction.reg2) | MEMORY;
+                break;
+
+            case ARM_I::STR_REG:
+                unit.is_memory = true;
+                unit.defs = MEMORY;
+                unit.uses = reg_bit(instruction.reg1) | reg_bit(instruction.reg2);
+                break;
+
+            case ARM_I::PUSH_REG:
+                unit.is_memory = true;
+                unit.defs = sp;
+                unit.uses = reg_bit(instruction.reg1) | sp;
+                break;
+
+            case ARM_I::POP_REG:
+                unit.latency = latencies.load;
+                unit.is_memory = true;
+                unit.defs = reg_bit(instruction.reg1) | sp;
+                unit.uses = sp;
+                break;
+
+            case ARM_I::PUSH_MULT_REG:
+            case ARM_I::POP_MULT_REG:
+                //prologue and epilogue are added after scheduling
+                assert(false);
+
+            default:
+                unit.latency = latencies.alu;
+                unit.defs = reg_bit(instruction.reg1);
+                unit.uses = reg_bit(instruction.reg2) | op2;
+                break;
+        }
+
+        units.push_back(std::move(unit));
+    }
+
+    for (size_t j = 0; j < units.size(); ++j) {
+        for (size_t i = 0; i < j; ++i) {
+            bool read_after_write = units[i].defs & units[j].uses;
+            bool write_after_read = units[i].uses & units[j].defs;
+            bool write_after_write = units[i].defs & units[j].defs;
+
+            if (read_after_write) {
+                units[i].successors.emplace_back(j, units[i].latency);
+            } else if (write_after_read || write_after_write) {
+                units[i].successors.emplace_back(j, 0);
+            } else {
+                continue;
+            }
+            ++units[j].predecessors;
+        }
+    }
+
+    for (size_t i = units.size(); i > 0; --i) {
+        Unit& unit = units[i - 1];
+        unit.priority = unit.latency;
+        for (auto [successor, latency] : unit.successors) {
+            unit.priority = std::max(unit.priority, latency + units[successor].priority);
+        }
+    }
+
+    std::vector<instruction_t> scheduled = {};
+    std::vector<bool> done(units.size(), false);
+    size_t cycle = 0;
+    size_t issued = 0;
+    bool memory_issued = false;
+    bool multiply_issued = false;
+
+    for (size_t left = units.size(); left > 0;) {
+        std::optional<size_t> best = std::nullopt;
+
+        for (size_t i = 0; i < units.size(); ++i) {
+            const Unit& unit = units[i];
+            if (done[i] || unit.predecessors > 0 || unit.ready_cycle > cycle) continue;
+            if (unit.is_call && issued > 0) continue;
+            if (unit.is_memory && memory_issued) continue;
+            if (unit.is_multiply && multiply_issued) continue;
+            if (!best || unit.priority > units[*best].priority) {
+                best = i;
+            }
+        }
+
+        if (!best || issued == latencies.issue_width) {
+            ++cycle;
+            issued = 0;
+            memory_issued = false;
+            multiply_issued = false;
+            continue;
+        }
+
+        Unit& unit = units[*best];
+        done[*best] = true;
+        --left;
+        ++issued;
+        memory_issued |= unit.is_memory;
+        multiply_issued |= unit.is_multiply;
+        if (unit.is_call) {
+            issued = latencies.issue_width;
+        }
+
+        for (auto [successor, latency] : unit.successors) {
+            --units[successor].predecessors;
+            units[successor].ready_cycle = std::max(units[successor].ready_cycle, cycle + latency);
+        }
+        scheduled.push_back(std::move(instructions_[*best]));
+    }
+
+    instructions_ = std::move(scheduled);
+}
@@ -0,0 +1,767 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Tree-pattern instruction selector
+ */
+
+#include "../include/JIT_compiler.hpp"
+#include "../include/JIT_IR.hpp"
+
+namespace {
+
+constexpr size_t INFINITE_COST = SIZE_MAX / 4;
+
+uint32_t ConstantValue(const Node* node) {
+    return static_cast<uint32_t>(std::stoul(*node->content, nullptr, 0));
+}
+
+/* Returns k if value is 2^k, k > 0 */
+std::optional<uint32_t> PowerOfTwo(uint32_t value) {
+    if (value < 2 || (value & (value - 1)) != 0) {
+        return std::nullopt;
+    }
+    uint32_t k = 0;
+    while ((1u << k) != value) ++k;
+    return k;
+}
+
+}
+
+const std::vector<ARM_JIT_Compiler::Rule>& ARM_JIT_Compiler::rules() {
+    /* Pattern table
+     * Every row is: result nonterminal, pattern, cost, predicate on the matched root, emitter.
+     * Emitter gets operands for the nonterminal leaves of the pattern (left to right)
+     * and puts the result to rd.
+     * Costs are roughly the number of cycles on an in-order core.
+     */
+    using ET = ExpressionType;
+
+    auto leaf = [](NonTerminal nonterminal) { return Pattern{std::nullopt, nonterminal, {}, false}; };
+    auto op = [](ExpressionType type, std::vector<Pattern> children) {
+        return Pattern{type, NT::Reg, std::move(children), false};
+    };
+
+    static const std::vector<Rule> table = {
+        //constants
+        {NT::Reg, op(ET::Constant, {}), 2,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node* node, const std::vector<Operand>&) {
+             c.instructions_.emplace_back(ARM_I::LDR_LITERAL, rd, std::nullopt, std::nullopt, node->content);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Constant, {}), 1,
+         [](const Node* node) { return A32_ModifiedImmediate(~ConstantValue(node)).has_value(); },
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node* node, const std::vector<Operand>&) {
+             c.emit(ARM_I::MVN, rd, std::nullopt, Operand{std::nullopt, ~ConstantValue(node)});
+             return Operand{rd};
+         }},
+        {NT::Imm, op(ET::Constant, {}), 0,
+         [](const Node* node) { return A32_ModifiedImmediate(ConstantValue(node)).has_value(); },
+         [](ARM_JIT_Compiler&, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{std::nullopt, ConstantValue(node)};
+         }},
+        {NT::NegImm, op(ET::Constant, {}), 0,
+         [](const Node* node) { return A32_ModifiedImmediate(-ConstantValue(node)).has_value(); },
+         [](ARM_JIT_Compiler&, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{std::nullopt, -ConstantValue(node)};
+         }},
+        {NT::Shift, op(ET::Constant, {}), 0,
+         [](const Node* node) { return PowerOfTwo(ConstantValue(node)).has_value(); },
+         [](ARM_JIT_Compiler&, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{std::nullopt, PowerOfTwo(ConstantValue(node))};
+         }},
+        {NT::ShiftPlusOne, op(ET::Constant, {}), 0,
+         [](const Node* node) { return PowerOfTwo(ConstantValue(node) - 1).has_value(); },
+         [](ARM_JIT_Compiler&, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{std::nullopt, PowerOfTwo(ConstantValue(node) - 1)};
+         }},
+        {NT::ShiftMinusOne, op(ET::Constant, {}), 0,
+         [](const Node* node) { return PowerOfTwo(ConstantValue(node) + 1).has_value(); },
+         [](ARM_JIT_Compiler&, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{std::nullopt, PowerOfTwo(ConstantValue(node) + 1)};
+         }},
+
+        //variables: ldr rd, =address; ldr rd, [rd]
+        {NT::Reg, op(ET::Variable, {}), 2,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node* node, const std::vector<Operand>&) {
+             c.load_variable(rd, *node->content);
+             return Operand{rd};
+         }},
+
+        //function argument, copied at the entry
+        {NT::Reg, op(ET::Argument, {}), 0,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{c.argument_registers_.at(static_cast<uint32_t>(std::stoul(*node->content)))};
+         }},
+
+        //value computed by an earlier tree
+        {NT::Reg, op(ET::Value, {}), 0,
+         nullptr,
+         [](ARM_JIT_Compiler&, ARM_R, const Node* node, const std::vector<Operand>&) {
+             return Operand{static_cast<ARM_R>(std::stoul(*node->content))};
+         }},
+
+        //chain rules
+        {NT::Reg, leaf(NT::Imm), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::MOV, rd, std::nullopt, o[0]);
+             return Operand{rd};
+         }},
+        {NT::Reg, leaf(NT::Shifted), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::MOV, rd, std::nullopt, o[0]);
+             return Operand{rd};
+         }},
+
+        //shifted register operand: x*2^k -> x, lsl #k
+        {NT::Shifted, op(ET::Product, {leaf(NT::Reg), leaf(NT::Shift)}), 0,
+         nullptr,
+         [](ARM_JIT_Compiler&, ARM_R, const Node*, const std::vector<Operand>& o) {
+             return Operand{o[0].reg, std::nullopt, *o[1].immediate};
+         }},
+        {NT::Shifted, op(ET::Product, {leaf(NT::Shift), leaf(NT::Reg)}), 0,
+         nullptr,
+         [](ARM_JIT_Compiler&, ARM_R, const Node*, const std::vector<Operand>& o) {
+             return Operand{o[1].reg, std::nullopt, *o[0].immediate};
+         }},
+
+        //addition
+        {NT::Reg, op(ET::Plus, {leaf(NT::Reg), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::Reg), leaf(NT::Imm)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::Imm), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[1].reg, o[0]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::Reg), leaf(NT::NegImm)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::SUB, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::NegImm), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::SUB, rd, o[1].reg, o[0]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::Reg), leaf(NT::Shifted)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::Shifted), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[1].reg, o[0]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {op(ET::Product, {leaf(NT::Reg), leaf(NT::Reg)}), leaf(NT::Reg)}), 3,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.instructions_.emplace_back(ARM_I::MLA, rd, o[0].reg, o[1].reg, std::nullopt,
+                                          std::nullopt, 0, o[2].reg);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Plus, {leaf(NT::Reg), op(ET::Product, {leaf(NT::Reg), leaf(NT::Reg)})}), 3,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.instructions_.emplace_back(ARM_I::MLA, rd, o[1].reg, o[2].reg, std::nullopt,
+                                          std::nullopt, 0, o[0].reg);
+             return Operand{rd};
+         }},
+
+        //subtraction
+        {NT::Reg, op(ET::Minus, {leaf(NT::Reg), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::SUB, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Minus, {leaf(NT::Reg), leaf(NT::Imm)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::SUB, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Minus, {leaf(NT::Reg), leaf(NT::NegImm)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Minus, {leaf(NT::Imm), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::RSB, rd, o[1].reg, o[0]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Minus, {leaf(NT::Reg), leaf(NT::Shifted)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::SUB, rd, o[0].reg, o[1]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Minus, {leaf(NT::Shifted), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::RSB, rd, o[1].reg, o[0]);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Minus, {leaf(NT::Reg), op(ET::Product, {leaf(NT::Reg), leaf(NT::Reg)})}), 3,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.instructions_.emplace_back(ARM_I::MLS, rd, o[1].reg, o[2].reg, std::nullopt,
+                                          std::nullopt, 0, o[0].reg);
+             return Operand{rd};
+         }},
+
+        //multiplication
+        {NT::Reg, op(ET::Product, {leaf(NT::Reg), leaf(NT::Reg)}), 3,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.instructions_.emplace_back(ARM_I::MUL, rd, o[0].reg, o[1].reg, std::nullopt);
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Product, {leaf(NT::Reg), leaf(NT::ShiftPlusOne)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[0].reg, Operand{o[0].reg, std::nullopt, *o[1].immediate});
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Product, {leaf(NT::ShiftPlusOne), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::ADD, rd, o[1].reg, Operand{o[1].reg, std::nullopt, *o[0].immediate});
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Product, {leaf(NT::Reg), leaf(NT::ShiftMinusOne)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::RSB, rd, o[0].reg, Operand{o[0].reg, std::nullopt, *o[1].immediate});
+             return Operand{rd};
+         }},
+        {NT::Reg, op(ET::Product, {leaf(NT::ShiftMinusOne), leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::RSB, rd, o[1].reg, Operand{o[1].reg, std::nullopt, *o[0].immediate});
+             return Operand{rd};
+         }},
+
+        //unary minus: rsb rd, rn, #0
+        {NT::Reg, op(ET::Negate, {leaf(NT::Reg)}), 1,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node*, const std::vector<Operand>& o) {
+             c.emit(ARM_I::RSB, rd, o[0].reg, Operand{std::nullopt, 0});
+             return Operand{rd};
+         }},
+
+        //function call, arguments are passed in r0-r3
+        {NT::Reg, Pattern{ET::Function, NT::Reg, {leaf(NT::Reg)}, true}, 4,
+         nullptr,
+         [](ARM_JIT_Compiler& c, ARM_R rd, const Node* node, const std::vector<Operand>& o) {
+             c.emit_call(rd, *node->content, o);
+             return Operand{rd};
+         }},
+    };
+    return table;
+}
+
+size_t ARM_JIT_Compiler::match(const Pattern& pattern, const Node* current) const {
+    /* Cost of the pattern subtrees matched at current (without the rule cost) */
+    if (!pattern.op) {
+        return labels_.at(current).cost[static_cast<size_t>(pattern.leaf)];
+    }
+
+    if (*pattern.op != current->type) {
+        return INFINITE_COST;
+    }
+    if (!pattern.variadic && pattern.children.size() != current->sub_expressions.size()) {
+        return INFINITE_COST;
+    }
+
+    size_t cost = 0;
+    for (size_t i = 0; i < current->sub_expressions.size(); ++i) {
+        const Pattern& child = pattern.variadic ? pattern.children[0] : pattern.children[i];
+        cost += match(child, current->sub_expressions[i].get());
+        cost = std::min(cost, INFINITE_COST);
+    }
+    return cost;
+}
+
+void ARM_JIT_Compiler::label(const Node* current) {
+    /* Bottom-up labeling: cheapest rule for every nonterminal.
+     * Chain rules (pattern is a single nonterminal) are applied until nothing changes
+     */
+    for (const auto& sub_expression : current->sub_expressions) {
+        label(sub_expression.get());
+    }
+
+    Label& result = labels_[current];
+    result.cost.fill(INFINITE_COST);
+    result.rule.fill(nullptr);
+
+    for (const Rule& rule : rules()) {
+        if (!rule.pattern.op) {
+            continue;
+        }
+        size_t cost = match(rule.pattern, current);
+        if (cost == INFINITE_COST || (rule.predicate && !rule.predicate(current))) {
+            continue;
+        }
+        auto goal = static_cast<size_t>(rule.result);
+        if (cost + rule.cost < result.cost[goal]) {
+            result.cost[goal] = cost + rule.cost;
+            result.rule[goal] = &rule;
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (const Rule& rule : rules()) {
+            if (rule.pattern.op) {
+                continue;
+            }
+            size_t cost = result.cost[static_cast<size_t>(rule.pattern.leaf)];
+            auto goal = static_cast<size_t>(rule.result);
+            if (cost != INFINITE_COST && cost + rule.cost < result.cost[goal]) {
+                result.cost[goal] = cost + rule.cost;
+                result.rule[goal] = &rule;
+                changed = true;
+            }
+        }
+    }
+}
+
+void ARM_JIT_Compiler::collect_leaves(const Pattern& pattern, const Node* current,
+                                      std::vector<std::pair<const Node*, NonTerminal>>& leaves) const {
+    if (!pattern.op) {
+        leaves.emplace_back(current, pattern.leaf);
+        return;
+    }
+    for (size_t i = 0; i < current->sub_expressions.size(); ++i) {
+        const Pattern& child = pattern.variadic ? pattern.children[0] : pattern.children[i];
+        collect_leaves(child, current->sub_expressions[i].get(), leaves);
+    }
+}
+
+size_t ARM_JIT_Compiler::registers_needed(const Node* current, NonTerminal goal) {
+    /* Sethi-Ullman number for the selected rule:
+     * how many registers are needed to compute it without spilling
+     */
+    auto key = std::make_pair(current, goal);
+    auto cached = registers_needed_.find(key);
+    if (cached != registers_needed_.end()) {
+        return cached->second;
+    }
+
+    const Rule* rule = labels_.at(current).rule[static_cast<size_t>(goal)];
+    std::vector<std::pair<const Node*, NonTerminal>> leaves = {};
+    collect_leaves(rule->pattern, current, leaves);
+
+    std::vector<size_t> needs = {};
+    for (auto [leaf, nonterminal] : leaves) {
+        size_t need = registers_needed(leaf, nonterminal);
+        if (need > 0) {
+            needs.push_back(need);
+        }
+    }
+    std::sort(needs.rbegin(), needs.rend());
+
+    size_t needed = (goal == NT::Reg) ? 1 : 0;
+    for (size_t i = 0; i < needs.size(); ++i) {
+        needed = std::max(needed, needs[i] + i);
+    }
+    registers_needed_[key] = needed;
+    return needed;
+}
+
+ARM_JIT_Compiler::Operand ARM_JIT_Compiler::reduce(const Node* current, NonTerminal goal) {
+    /* Emits the code for the selected rule, result goes to a new virtual register.
+     * Operand which needs more registers is computed first,
+     * so fewer values are alive at the same time
+     */
+    const Rule* rule = labels_.at(current).rule[static_cast<size_t>(goal)];
+    assert(rule != nullptr);
+
+    std::vector<std::pair<const Node*, NonTerminal>> leaves = {};
+    collect_leaves(rule->pattern, current, leaves);
+
+    std::vector<size_t> order(leaves.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this, &leaves](size_t lhs, size_t rhs) {
+        return registers_needed(leaves[lhs].first, leaves[lhs].second) >
+               registers_needed(leaves[rhs].first, leaves[rhs].second);
+    });
+
+    std::vector<Operand> operands(leaves.size());
+    for (size_t i : order) {
+        operands[i] = reduce(leaves[i].first, leaves[i].second);
+    }
+
+    return rule->emit(*this, new_virtual_register(), current, operands);
+}
+
+void ARM_JIT_Compiler::lower(const IR_Function& function) {
+    /* IR values used once are put back into expression trees,
+     * so patterns can match across several IR instructions (mla, shifts, immediates):
+     *
+     * %2 = mul %0, %1
+     * %4 = add %2, %3     ->   add(mul(%0, %1), %3)  ->  mla v2, v0, v1, v3
+     *
+     * Constants and addresses are rematerialized in every tree,
+     * calls and values used several times are roots of their own trees:
+     * they are computed once and used as Value leaves later.
+     * Values are not moved below a call: the call may change a loaded variable,
+     * and results of the calls would stay in registers until the tree is computed.
+     *
+     * Variables of the block (CompilerOptions::variable_block) are read relative to
+     * one base register. Those adjacent in memory and read between the same calls
+     * are loaded together before the first tree after the call:
+     *
+     * ldmia v0, {v1, v2, v3}   ->  a, b, c are Value leaves
+     */
+    const auto& code = function.instructions;
+    std::map<vreg_t, size_t> definition = {};
+    std::map<vreg_t, size_t> uses = {};
+    std::map<vreg_t, size_t> user = {};
+    std::vector<size_t> calls_before(code.size() + 1, 0);
+
+    for (size_t i = 0; i < code.size(); ++i) {
+        definition[code[i].result] = i;
+        for (vreg_t argument : code[i].arguments) {
+            ++uses[argument];
+            user[argument] = i;
+        }
+        calls_before[i + 1] = calls_before[i] + (code[i].opcode == IR_Opcode::Call ? 1 : 0);
+    }
+    std::map<vreg_t, std::vector<size_t>> outputs = {};     //value -> indices in the output array
+    for (size_t k = 0; k < function.results.size(); ++k) {
+        ++uses[function.results[k]];
+        outputs[function.results[k]].push_back(k);
+    }
+
+    std::vector<bool> is_root(code.size(), false);
+    std::vector<size_t> root(code.size(), 0);
+    for (size_t i = code.size(); i > 0; --i) {
+        const IR_Instruction& instruction = code[i - 1];
+        size_t count = uses[instruction.result];
+        bool is_result = outputs.count(instruction.result) > 0;
+
+        if (count == 0 && instruction.opcode != IR_Opcode::Call) {
+            root[i - 1] = i - 1;
+            continue;       //dead value, nothing to emit
+        }
+
+        switch (instruction.opcode) {
+            case IR_Opcode::Const:
+            case IR_Opcode::Address:
+            case IR_Opcode::Argument:
+                is_root[i - 1] = is_result;
+                break;
+
+            case IR_Opcode::Call:
+                is_root[i - 1] = true;
+                break;
+
+            default:
+                is_root[i - 1] = is_result || count > 1 ||
+                                 calls_before[root[user.at(instruction.result)]] > calls_before[i];
+                break;
+        }
+        root[i - 1] = is_root[i - 1] ? i - 1 : root[user.at(instruction.result)];
+    }
+
+    if (options_.addressing == SYMBOL_ADDRESSING::TABLE) {
+        /* Table pointer is a value like any other: it stays in r0 while nothing
+         * is called, otherwise it gets a callee-saved register or a spill slot
+         */
+        table_register_ = new_virtual_register();
+        emit(ARM_I::MOV, *table_register_, std::nullopt, Operand{ARM_R::R0});
+    }
+    size_t first_argument = table_register_ ? 1 : 0;
+
+    /* Function of several results takes the output array next */
+    std::optional<ARM_R> output_register = std::nullopt;
+    if (parse_tree_->type == ExpressionType::List) {
+        output_register = new_virtual_register();
+        emit(ARM_I::MOV, *output_register, std::nullopt, Operand{static_cast<ARM_R>(first_argument)});
+        ++first_argument;
+    }
+
+    /* Arguments are copied at the entry: the ones in r0-r3 stay there while nothing
+     * is called (the copy is removed), the ones on the stack are loaded from there
+     */
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].opcode != IR_Opcode::Argument || uses[code[i].result] == 0 || !is_root[root[i]] ||
+            argument_registers_.count(code[i].constant) > 0) {
+            continue;
+        }
+        ARM_R value = new_virtual_register();
+        argument_registers_[code[i].constant] = value;
+        size_t position = code[i].constant + first_argument;
+        if (position < 4) {
+            emit(ARM_I::MOV, value, std::nullopt, Operand{static_cast<ARM_R>(position)});
+        } else {
+            instructions_.emplace_back(ARM_I::LDR_REG, value, ARM_R::SP, std::nullopt, std::nullopt,
+                                       (position - 4) * 4);
+            instructions_.back().is_stack_argument = true;
+        }
+    }
+
+    /* Loads of the block variables which are emitted: offset -> loaded values, per call-free segment */
+    std::map<size_t, std::map<uint32_t, std::vector<vreg_t>>> block_loads = {};
+    if (options_.variable_block) {
+        assert(options_.addressing == SYMBOL_ADDRESSING::LITERAL);
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].opcode != IR_Opcode::Load || uses[code[i].result] == 0 || !is_root[root[i]]) {
+                continue;
+            }
+            const std::string& name = code[definition.at(code[i].arguments[0])].symbol;
+            auto offset = options_.variable_block->offsets.find(name);
+            if (offset != options_.variable_block->offsets.end()) {
+                assert(offset->second % 4 == 0);
+                block_loads[calls_before[i]][offset->second].push_back(code[i].result);
+            }
+        }
+    }
+    if (!block_loads.empty()) {
+        /* Base register points to the first variable read, so ldmia starts there */
+        block_start_ = UINT32_MAX;
+        for (const auto& [segment, loads] : block_loads) {
+            block_start_ = std::min(block_start_, loads.begin()->first);
+        }
+        std::stringstream hex_stream;
+        hex_stream << std::hex << reinterpret_cast<uintptr_t>(options_.variable_block->base) + block_start_;
+        block_register_ = new_virtual_register();
+        instructions_.emplace_back(ARM_I::LDR_LITERAL, *block_register_, std::nullopt, std::nullopt,
+                                   "0x" + hex_stream.str());
+    }
+
+    std::map<vreg_t, ARM_R> registers = {};
+    std::function<std::unique_ptr<Node>(vreg_t)> build = [&](vreg_t value) {
+        auto node = std::make_unique<Node>();
+        auto computed = registers.find(value);
+        if (computed != registers.end()) {
+            node->type = ExpressionType::Value;
+            node->content = std::to_string(static_cast<size_t>(computed->second));
+            return node;
+        }
+
+        const IR_Instruction& instruction = code[definition.at(value)];
+        switch (instruction.opcode) {
+            case IR_Opcode::Const: {
+                std::stringstream hex_stream;
+                hex_stream << std::hex << instruction.constant;
+                node->type = ExpressionType::Constant;
+                node->content = "0x" + hex_stream.str();
+                return node;
+            }
+
+            case IR_Opcode::Load: {
+                const IR_Instruction& address = code[definition.at(instruction.arguments[0])];
+                assert(address.opcode == IR_Opcode::Address);
+                node->type = ExpressionType::Variable;
+                node->content = address.symbol;
+                return node;
+            }
+
+            case IR_Opcode::Add:
+                node->type = ExpressionType::Plus;
+                break;
+
+            case IR_Opcode::Sub:
+                node->type = ExpressionType::Minus;
+                break;
+
+            case IR_Opcode::Mul:
+                node->type = ExpressionType::Product;
+                break;
+
+            case IR_Opcode::Neg:
+                node->type = ExpressionType::Negate;
+                break;
+
+            case IR_Opcode::Call:
+                node->type = ExpressionType::Function;
+                node->content = instruction.symbol;
+                break;
+
+            case IR_Opcode::Argument:
+                node->type = ExpressionType::Argument;
+                node->content = std::to_string(instruction.constant);
+                return node;
+
+            default:
+                assert(false);
+        }
+
+        for (vreg_t argument : instruction.arguments) {
+            node->sub_expressions.push_back(build(argument));
+        }
+        return node;
+    };
+
+    auto load_block = [&](const std::map<uint32_t, std::vector<vreg_t>>& loads) {
+        /* Runs of two adjacent words from the base (ldmia, ldmib), of three or more
+         * anywhere (add v, base, #offset; ldmia v). Others stay single ldr in the trees
+         */
+        for (auto run = loads.begin(); run != loads.end();) {
+            auto end = std::next(run);
+            while (end != loads.end() && end->first == std::prev(end)->first + 4 &&
+                   static_cast<size_t>(std::distance(run, end)) < LDM_REGISTERS) {
+                ++end;
+            }
+            auto length = static_cast<size_t>(std::distance(run, end));
+            uint32_t offset = run->first - block_start_;
+            bool is_direct = offset <= 4;
+            bool is_encodable = A32_ModifiedImmediate(offset).has_value();
+
+            if (length >= 2 && (is_direct || (length >= 3 && is_encodable))) {
+                ARM_R base = *block_register_;
+                if (!is_direct) {
+                    base = new_virtual_register();
+                    emit(ARM_I::ADD, base, *block_register_, Operand{std::nullopt, offset});
+                    offset = 0;
+                }
+                instruction_t ldm(ARM_I::LDM_REG, std::nullopt, base, std::nullopt, std::nullopt, offset);
+                for (auto word = run; word != end; ++word) {
+                    ldm.registers.push_back(new_virtual_register());
+                    for (vreg_t value : word->second) {
+                        registers[value] = ldm.registers.back();
+                    }
+                }
+                instructions_.push_back(std::move(ldm));
+            }
+            run = end;
+        }
+    };
+
+    std::optional<size_t> loaded_segment = std::nullopt;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (!is_root[i]) {
+            continue;
+        }
+        auto segment = block_loads.find(calls_before[i]);
+        if (segment != block_loads.end() && loaded_segment != calls_before[i]) {
+            load_block(segment->second);
+            loaded_segment = calls_before[i];
+        }
+        std::unique_ptr<Node> tree = build(code[i].result);
+        labels_.clear();
+        registers_needed_.clear();
+        label(tree.get());
+        registers[code[i].result] = *reduce(tree.get(), NonTerminal::Reg).reg;
+
+        /* Results are stored as soon as they are computed, so they do not hold registers */
+        auto output = outputs.find(code[i].result);
+        if (output_register && output != outputs.end()) {
+            for (size_t k : output->second) {
+                assert(k * 4 < 4096);     //str immediate offset
+                instructions_.emplace_back(ARM_I::STR_REG, registers.at(code[i].result), *output_register,
+                                           std::nullopt, std::nullopt, k * 4);
+            }
+        }
+    }
+
+    if (!output_register) {
+        emit(ARM_I::MOV, ARM_R::R0, std::nullopt, Operand{registers.at(function.results[0])});
+    }
+}
+
+void ARM_JIT_Compiler::emit(ARM_INSTRUCTION type, ARM_REGISTER rd, std::optional<ARM_REGISTER> rn,
+                            const Operand& op2) {
+    /* Data processing instruction: rd = rn (op) op2 */
+    instructions_.emplace_back(type, rd, rn, op2.reg, std::nullopt, op2.immediate, op2.shift);
+}
+
+void ARM_JIT_Compiler::emit_call(ARM_REGISTER rd, const std::string& name, const std::vector<Operand>& arguments) {
+    /* Handling Function call
+     * ARM instructions for that:
+     *
+     * mov r0, r4
+     * ...
+     * mov r3, r7
+     * ldr ip, =0xfb1cfcd0
+     * blx ip
+     * mov r4, r0
+     */
+    assert(!arguments.empty() && arguments.size() <= 4);
+
+    for (size_t i = 0; i < arguments.size(); ++i) {
+        auto argument_register = static_cast<ARM_R>(static_cast<size_t>(ARM_R::R0) + i);
+        if (arguments[i].reg != argument_register) {
+            emit(ARM_I::MOV, argument_register, std::nullopt, arguments[i]);
+        }
+    }
+
+    if (options_.call_veneers && options_.addressing == SYMBOL_ADDRESSING::LITERAL) {
+        /* bl name             (veneer: ldr pc, [pc, #-4]; .word name) */
+        instructions_.emplace_back(ARM_I::BL, std::nullopt, std::nullopt, std::nullopt, get_address(name));
+        instructions_.back().symbol = name;
+    } else {
+        load_address(ARM_R::IP, name);
+        instructions_.emplace_back(ARM_I::BLX, ARM_R::IP, std::nullopt, std::nullopt, std::nullopt);
+    }
+    emit(ARM_I::MOV, rd, std::nullopt, Operand{ARM_R::R0});
+}
+
+void ARM_JIT_Compiler::load_address(ARM_REGISTER rd, const std::string& name) {
+    /* ldr rd, =address                 (LITERAL)
+     * ldr rd, [table, #slot * 4]       (TABLE, slots in the order of the first use)
+     */
+    if (options_.addressing == SYMBOL_ADDRESSING::LITERAL) {
+        instructions_.emplace_back(ARM_I::LDR_LITERAL, rd, std::nullopt, std::nullopt, get_address(name));
+        instructions_.back().symbol = name;
+        return;
+    }
+
+    auto slot = std::find(symbol_slots_.begin(), symbol_slots_.end(), name);
+    if (slot == symbol_slots_.end()) {
+        slot = symbol_slots_.insert(slot, name);
+    }
+    auto offset = static_cast<uint32_t>(std::distance(symbol_slots_.begin(), slot) * 4);
+    assert(offset < 4096);      //ldr immediate offset
+    instructions_.emplace_back(ARM_I::LDR_REG, rd, *table_register_, std::nullopt, std::nullopt, offset);
+}
+
+void ARM_JIT_Compiler::load_variable(ARM_REGISTER rd, const std::string& name) {
+    /* ldr rd, [block, #offset]         (variable of the block)
+     * address; ldr rd, [rd]            (others)
+     */
+    std::optional<uint32_t> offset = block_offset(name);
+    if (offset) {
+        instructions_.emplace_back(ARM_I::LDR_REG, rd, *block_register_, std::nullopt, std::nullopt, *offset);
+        return;
+    }
+    load_address(rd, name);
+    instructions_.emplace_back(ARM_I::LDR_REG, rd, rd, std::nullopt, std::nullopt);
+}
+
+std::optional<uint32_t> ARM_JIT_Compiler::block_offset(const std::string& name) const {
+    if (!block_register_) {
+        return std::nullopt;
+    }
+    auto offset = options_.variable_block->offsets.find(name);
+    if (offset == options_.variable_block->offsets.end()) {
+        return std::nullopt;
+    }
+    assert(offset->second - block_start_ < 4096);     //ldr immediate offset
+    return offset->second - block_start_;
+}
@@ -0,0 +1,349 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Cache of compiled functions shared by processes
+ */
+
+#include "../include/JIT_shared_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t BYTES_PER_SLOT = 256;      //index is sized for functions of this size on average
+constexpr size_t ATTACH_ATTEMPTS = 1000;    //1 ms apart, for the creator to initialize the segment
+
+std::string WithoutSpaces(const char* expression) {
+    std::string text = {};
+    for (const char* current = expression; *current != '\0'; ++current) {
+        if (!std::isspace(static_cast<unsigned char>(*current))) {
+            text.push_back(*current);
+        }
+    }
+    return text;
+}
+
+uint32_t Hash(const std::string& key) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (char symbol : key) {
+        hash = (hash ^ static_cast<uint8_t>(symbol)) * 16777619u;
+    }
+    return hash;
+}
+
+size_t RoundUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+SharedCodeCache::SharedCodeCache(const std::string& name, size_t capacity_bytes, const symbol_t* externs,
+                                 CompilerOptions options)
+    : externs_(externs), options_(std::move(options)) {
+    /* The block address is of this process only, shared code takes the variables from the table */
+    options_.addressing = SYMBOL_ADDRESSING::TABLE;
+    options_.variable_block = std::nullopt;
+    if (!attach(name, capacity_bytes)) {
+        if (writable_ != nullptr) {
+            munmap(writable_, size_);
+        }
+        writable_ = nullptr;
+        header_ = nullptr;
+    }
+}
+
+SharedCodeCache::~SharedCodeCache() {
+    if (executable_ != nullptr) {
+        munmap(executable_, header_->data_size);
+    }
+    if (writable_ != nullptr) {
+        munmap(writable_, size_);
+    }
+}
+
+void SharedCodeCache::Remove(const std::string& name) {
+    shm_unlink(name.c_str());
+}
+
+bool SharedCodeCache::attached() const {
+    return executable_ != nullptr;
+}
+
+void* SharedCodeCache::get(const char* expression) {
+    std::string spelling = WithoutSpaces(expression);
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto known = spellings_.find(spelling);
+    if (known != spellings_.end()) {
+        ++stats_.hits;
+        return known->second;
+    }
+
+    ARM_JIT_Compiler compiler(AddressMap(externs_), options_);
+    compiler.parse(expression);
+    std::string canonical = compiler.GetCanonicalForm();
+
+    auto function = functions_.find(canonical);
+    if (function != functions_.end()) {
+        ++stats_.hits;
+        spellings_.emplace(std::move(spelling), function->second);
+        return function->second;
+    }
+
+    auto remember = [this, &spelling, &canonical](void* entry) {
+        if (entry != nullptr) {
+            functions_.emplace(canonical, entry);
+            spellings_.emplace(spelling, entry);
+        }
+        return entry;
+    };
+    auto symbols_of = [this](const Slot* slot) {
+        std::vector<std::string> symbols = {};
+        const char* name = reinterpret_cast<const char*>(writable_ + header_->data_offset + slot->record) +
+                           slot->key_size;
+        for (uint32_t i = 0; i < slot->symbol_count; ++i) {
+            symbols.emplace_back(name);
+            name += symbols.back().size() + 1;
+        }
+        return symbols;
+    };
+
+    uint32_t hash = Hash(canonical);
+    if (attached()) {
+        const Slot* slot = find(canonical, hash);
+        if (slot != nullptr) {
+            ++stats_.shared_hits;
+            uint8_t* code = executable_ + slot->code;
+            FlushInstructionCache(code, code + slot->code_size);    //written by another process
+            return remember(bind(code, symbols_of(slot)));
+        }
+    }
+
+    ++stats_.misses;
+    compiler.compile();
+    std::vector<uint32_t> code = compiler.GetCompiledBinary();
+    const std::vector<std::string>& symbols = compiler.GetSymbolSlots();
+
+    if (attached()) {
+        const Slot* slot = publish(canonical, hash, symbols, code);
+        if (slot != nullptr) {
+            return remember(bind(executable_ + slot->code, symbols_of(slot)));
+        }
+    }
+
+    /* Segment is full or not mapped: the function stays in this process */
+    CodeBlock block = local_.allocate(code.size() * sizeof(uint32_t));
+    if (block.code == nullptr) {
+        return nullptr;
+    }
+    std::copy(code.begin(), code.end(), block.code);
+    local_.commit();
+    return remember(bind(static_cast<uint8_t*>(block.entry), symbols));
+}
+
+SharedCodeCacheStats SharedCodeCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+bool SharedCodeCache::attach(const std::string& name, size_t capacity_bytes) {
+    /* Layout: Header | Slot[slots] | padding | data (records)
+     * The creator sizes the segment and stores the magic after the header;
+     * others wait for it and take the sizes from the header
+     */
+    auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    bool is_creator = fd >= 0;
+    if (!is_creator) {
+        if (errno != EEXIST) {
+            return false;
+        }
+        fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+    }
+
+    size_t slots = 64;
+    while (slots * BYTES_PER_SLOT < capacity_bytes) {
+        slots *= 2;
+    }
+    size_t data_offset = RoundUp(sizeof(Header) + slots * sizeof(Slot), page_size);
+    size_t data_size = RoundUp(capacity_bytes, page_size);
+
+    if (is_creator) {
+        size_ = data_offset + data_size;
+        if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+    } else {
+        struct stat status = {};
+        for (size_t attempt = 0; attempt < ATTACH_ATTEMPTS; ++attempt) {
+            if (fstat(fd, &status) != 0 || status.st_size != 0) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        size_ = static_cast<size_t>(status.st_size);
+        if (size_ < sizeof(Header)) {
+            close(fd);
+            return false;
+        }
+    }
+
+    void* mapping = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    writable_ = static_cast<uint8_t*>(mapping);
+    header_ = reinterpret_cast<Header*>(writable_);
+    slots_ = reinterpret_cast<Slot*>(writable_ + sizeof(Header));
+
+    if (is_creator) {
+        //the new segment is zero-filled: all slots are EMPTY
+        header_->version = VERSION;
+        header_->options = OptionsFingerprint(options_);
+        header_->slots = static_cast<uint32_t>(slots);
+        header_->data_offset = static_cast<uint32_t>(data_offset);
+        header_->data_size = static_cast<uint32_t>(data_size);
+        header_->data_used.store(0, std::memory_order_relaxed);
+        header_->magic.store(MAGIC, std::memory_order_release);
+    } else {
+        for (size_t attempt = 0; header_->magic.load(std::memory_order_acquire) != MAGIC; ++attempt) {
+            if (attempt == ATTACH_ATTEMPTS) {
+                close(fd);
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (header_->version != VERSION || header_->options != OptionsFingerprint(options_) ||
+            size_t{header_->data_offset} + header_->data_size != size_) {
+            close(fd);
+            return false;
+        }
+    }
+
+    mapping = mmap(nullptr, header_->data_size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, header_->data_offset);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    executable_ = static_cast<uint8_t*>(mapping);
+    return true;
+}
+
+const SharedCodeCache::Slot* SharedCodeCache::find(const std::string& key, uint32_t hash) const {
+    /* Linear probing up to an empty slot. Slots being written are skipped:
+     * their fields are not there yet
+     */
+    uint32_t mask = header_->slots - 1;
+    const uint8_t* data = writable_ + header_->data_offset;
+    for (uint32_t i = 0; i < header_->slots; ++i) {
+        const Slot& slot = slots_[(hash + i) & mask];
+        uint32_t state = slot.state.load(std::memory_order_acquire);
+        if (state == EMPTY) {
+            return nullptr;
+        }
+        if (state == READY && slot.hash == hash && slot.key_size == key.size() &&
+            std::memcmp(data + slot.record, key.data(), key.size()) == 0) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+const SharedCodeCache::Slot* SharedCodeCache::publish(const std::string& key, uint32_t hash,
+                                                      const std::vector<std::string>& symbols,
+                                                      const std::vector<uint32_t>& code) {
+    /* The record is written to space taken from the data area, then an empty slot
+     * is claimed by compare-and-swap and filled. Readers see it after READY is stored.
+     * If the same key is published meanwhile, that slot is used and the record is left unused
+     */
+    size_t symbols_size = 0;
+    for (const auto& symbol : symbols) {
+        symbols_size += symbol.size() + 1;
+    }
+    size_t code_start = RoundUp(key.size() + symbols_size, 8);
+    size_t record_size = RoundUp(code_start + code.size() * sizeof(uint32_t), 8);
+
+    /* Space is taken only if it fits, so a full segment stays full and its end never wraps */
+    uint32_t record = header_->data_used.load(std::memory_order_relaxed);
+    do {
+        if (size_t{record} + record_size > header_->data_size) {
+            return nullptr;
+        }
+    } while (!header_->data_used.compare_exchange_weak(record, static_cast<uint32_t>(record + record_size),
+                                                       std::memory_order_relaxed));
+
+    uint8_t* data = writable_ + header_->data_offset + record;
+    std::memcpy(data, key.data(), key.size());
+    char* names = reinterpret_cast<char*>(data + key.size());
+    for (const auto& symbol : symbols) {
+        std::memcpy(names, symbol.c_str(), symbol.size() + 1);
+        names += symbol.size() + 1;
+    }
+    std::memcpy(data + code_start, code.data(), code.size() * sizeof(uint32_t));
+
+    uint8_t* executable = executable_ + record + code_start;
+    FlushInstructionCache(executable, executable + code.size() * sizeof(uint32_t));
+
+    uint32_t mask = header_->slots - 1;
+    for (uint32_t i = 0; i < header_->slots;) {
+        Slot& slot = slots_[(hash + i) & mask];
+        uint32_t state = EMPTY;
+        if (slot.state.compare_exchange_strong(state, WRITING, std::memory_order_acq_rel)) {
+            slot.hash = hash;
+            slot.record = record;
+            slot.key_size = static_cast<uint32_t>(key.size());
+            slot.symbol_count = static_cast<uint32_t>(symbols.size());
+            slot.code = static_cast<uint32_t>(record + code_start);
+            slot.code_size = static_cast<uint32_t>(code.size() * sizeof(uint32_t));
+            slot.state.store(READY, std::memory_order_release);
+            ++stats_.published;
+            return &slot;
+        }
+        if (state == READY && slot.hash == hash && slot.key_size == key.size() &&
+            std::memcmp(writable_ + header_->data_offset + slot.record, key.data(), key.size()) == 0) {
+            return &slot;
+        }
+        ++i;    //taken by another key or still being written
+    }
+    return nullptr;
+}
+
+void* SharedCodeCache::bind(const uint8_t* code, const std::vector<std::string>& symbols) {
+    /* Thunk with the relocation table of this process, see the header.
+     * Function without symbols does not read r0 and is called directly
+     */
+    if (symbols.empty()) {
+        return const_cast<uint8_t*>(code);
+    }
+
+    std::vector<void*> table = SymbolTable(symbols, externs_);
+    if (std::find(table.begin(), table.end(), nullptr) != table.end()) {
+        return nullptr;
+    }
+    std::vector<uint32_t> thunk = TableThunk(code, table);
+
+    CodeBlock block = local_.allocate(thunk.size() * sizeof(uint32_t));
+    if (block.code == nullptr) {
+        return nullptr;
+    }
+    std::copy(thunk.begin(), thunk.end(), block.code);
+    local_.commit();
+    return block.entry;
+}
@@ -0,0 +1,71 @@
+/*
+ * Danila Mishin
+ * ARM Just-In-Time Compiler
+ * Calls of cached functions while another thread fills the cache
+ */
+
+#include "../include/JIT_cache.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+namespace {
+
+int a = 7;
+int b = -3;
+int c = 100;
+
+int inc(int value) { return value + 1; }
+
+symbol_t symbols[] = {{"a", &a}, {"b", &b}, {"c", &c}, {"inc", reinterpret_cast<void*>(&inc)}, {nullptr, nullptr}};
+
+using function_t = int (*)();
+
+}
+
+int main() {
+    /* The caller keeps its functions pinned and calls them in a loop.
+     * The inserter compiles new expressions into the small cache, so blocks are evicted,
+     * freed and reused on the pages of the pinned functions (their pages must stay executable)
+     */
+    CodeCache cache(16u << 10u);
+    const char* expressions[] = {"a * b + c", "inc(a) - b", "c - a * 2", "inc(inc(c)) * b"};
+    const int expected[] = {a * b + c, inc(a) - b, c - a * 2, inc(inc(c)) * b};
+
+    std::atomic<bool> is_done(false);
+    std::atomic<size_t> failures(0);
+
+    std::thread caller([&]() {
+        while (!is_done) {
+            CodeCache::Pin pin(cache);
+            function_t functions[4] = {};
+            for (size_t i = 0; i < 4; ++i) {
+                functions[i] = reinterpret_cast<function_t>(cache.get(expressions[i], symbols));
+            }
+            for (size_t round = 0; round < 1000; ++round) {
+                for (size_t i = 0; i < 4; ++i) {
+                    if (functions[i] == nullptr || functions[i]() != expected[i]) {
+                        ++failures;
+                    }
+                }
+            }
+        }
+    });
+
+    for (int i = 0; i < 20000; ++i) {
+        std::string expression = "a * " + std::to_string(i) + " + inc(b)";
+        CodeCache::Pin pin(cache);
+        auto function = reinterpret_cast<function_t>(cache.get(expression.c_str(), symbols));
+        if (function == nullptr || function() != a * i + inc(b)) {
+            ++failures;
+        }
+    }
+    is_done = true;
+    caller.join();
+
+    CodeCacheStats stats = cache.stats();
+    printf("failures: %zu, evictions: %zu, compactions: %zu\n", failures.load(), stats.evictions, stats.compactions);
+    return failures == 0 ? 0 : 1;
+}